@@ -0,0 +1,446 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#ifndef PFXML_FANOUT_H_
+#define PFXML_FANOUT_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+
+namespace pfxml {
+
+// Single-pass fan-out of parser events to multiple consumers. Inline
+// consumers are called synchronously with the events of the parser. Threaded
+// consumers run on their own thread and receive copied event batches through
+// a bounded single-producer/single-consumer ring; if a ring is full, the
+// parser waits for the consumer (backpressure).
+
+// number of times a waiting side of a ring yields before it blocks
+static const size_t RING_SPINS = 128;
+
+class consumer {
+ public:
+  virtual ~consumer() {}
+
+  // called for every event, t is only valid during the call
+  virtual void event(const tag& t, size_t level) = 0;
+
+  // called after the last event
+  virtual void finish() {}
+};
+
+// bounded lock-free single-producer/single-consumer ring buffer. A side
+// which has to wait spins for a while and then blocks until the other side
+// made progress
+template <typename T>
+class spsc_ring {
+ public:
+  explicit spsc_ring(size_t cap);
+
+  bool push(const T& v);
+  bool pop(T* v);
+
+  // push or pop, waiting for a free slot or an element
+  void push_wait(const T& v);
+  void pop_wait(T* v);
+
+ private:
+  std::vector<T> _slots;
+  size_t _mask;
+
+  // blocked sides wait on _cv, the lock is only taken if _waiters is set
+  std::mutex _m;
+  std::condition_variable _cv;
+  std::atomic<size_t> _waiters;
+
+  // keep producer and consumer index on separate cache lines
+  char _pad0[64];
+  std::atomic<size_t> _head;
+  char _pad1[64];
+  std::atomic<size_t> _tail;
+  char _pad2[64];
+
+  bool full() const;
+  bool empty() const;
+  void block(bool push);
+  void wake();
+};
+
+// the end of a run with worker threads. A failing worker or producer marks
+// the run as failed, which the producer checks to stop early. Once all
+// workers drained their rings, either all of them finish their consumers or
+// none does, regardless of which one failed
+class run_barrier {
+ public:
+  run_barrier();
+
+  void reset(size_t workers);
+
+  void fail();
+  bool failed() const;
+
+  // called by a worker after its last batch, waits for all other workers
+  // and returns whether the consumer should be finished
+  bool drained();
+
+ private:
+  std::atomic<bool> _failed;
+  std::mutex _m;
+  std::condition_variable _cv;
+  size_t _workers;
+  size_t _drained;
+};
+
+// an immutable sequence of copied events, shared between threaded consumers
+class event_batch {
+ public:
+  event_batch();
+
+  template <typename F>
+  void add(const F& xml);
+
+  size_t size() const;
+  size_t bytes() const;
+
+  // replay the batch to a consumer
+  void replay(consumer* c) const;
+
+ private:
+  struct ev {
+    uint32_t level;
+    uint32_t name;
+    uint32_t text;
+    uint32_t attrs;
+    uint32_t nattrs;
+  };
+
+  std::vector<ev> _events;
+  std::vector<std::pair<uint32_t, uint32_t>> _attrs;
+  std::vector<char> _heap;
+
+  uint32_t str(const char* s);
+};
+
+class fanout {
+ public:
+  // ring_cap is the number of batches a threaded consumer may lag behind,
+  // batch_size the maximum number of events per batch
+  explicit fanout(size_t ring_cap = 64, size_t batch_size = 4096);
+  ~fanout();
+
+  // register a consumer, which is not owned by the fanout
+  void add(consumer* c, bool threaded = false);
+
+  // parse xml once and deliver all events to all consumers. Exceptions
+  // thrown by consumers stop the parsing and are rethrown after all threads
+  // have been stopped, no consumer is finished then
+  template <typename F>
+  void run(F& xml);
+
+ private:
+  typedef std::shared_ptr<const event_batch> batch_ptr;
+
+  struct worker {
+    consumer* c;
+    spsc_ring<batch_ptr>* ring;
+    std::thread thread;
+    std::exception_ptr exc;
+  };
+
+  size_t _ring_cap;
+  size_t _batch_size;
+  std::vector<consumer*> _inline;
+  std::vector<worker*> _workers;
+  run_barrier _barrier;
+
+  void publish(const batch_ptr& b);
+  static void work(worker* w, run_barrier* barrier);
+};
+
+// _____________________________________________________________________________
+template <typename T>
+inline spsc_ring<T>::spsc_ring(size_t cap)
+    : _waiters(0), _head(0), _tail(0) {
+  size_t c = 2;
+  while (c < cap) c *= 2;
+  _slots.resize(c);
+  _mask = c - 1;
+}
+
+// _____________________________________________________________________________
+template <typename T>
+inline bool spsc_ring<T>::push(const T& v) {
+  size_t tail = _tail.load(std::memory_order_relaxed);
+  if (tail - _head.load(std::memory_order_acquire) > _mask) return false;
+  _slots[tail & _mask] = v;
+  _tail.store(tail + 1, std::memory_order_release);
+  wake();
+  return true;
+}
+
+// _____________________________________________________________________________
+template <typename T>
+inline bool spsc_ring<T>::pop(T* v) {
+  size_t head = _head.load(std::memory_order_relaxed);
+  if (head == _tail.load(std::memory_order_acquire)) return false;
+  *v = std::move(_slots[head & _mask]);
+  _slots[head & _mask] = T();
+  _head.store(head + 1, std::memory_order_release);
+  wake();
+  return true;
+}
+
+// _____________________________________________________________________________
+template <typename T>
+inline void spsc_ring<T>::push_wait(const T& v) {
+  for (size_t i = 0; !push(v); i++) {
+    if (i < RING_SPINS) {
+      std::this_thread::yield();
+    } else {
+      block(true);
+    }
+  }
+}
+
+// _____________________________________________________________________________
+template <typename T>
+inline void spsc_ring<T>::pop_wait(T* v) {
+  for (size_t i = 0; !pop(v); i++) {
+    if (i < RING_SPINS) {
+      std::this_thread::yield();
+    } else {
+      block(false);
+    }
+  }
+}
+
+// _____________________________________________________________________________
+template <typename T>
+inline bool spsc_ring<T>::full() const {
+  return _tail.load(std::memory_order_relaxed) -
+             _head.load(std::memory_order_acquire) >
+         _mask;
+}
+
+// _____________________________________________________________________________
+template <typename T>
+inline bool spsc_ring<T>::empty() const {
+  return _head.load(std::memory_order_relaxed) ==
+         _tail.load(std::memory_order_acquire);
+}
+
+// _____________________________________________________________________________
+template <typename T>
+inline void spsc_ring<T>::block(bool push) {
+  std::unique_lock<std::mutex> lock(_m);
+  _waiters.fetch_add(1, std::memory_order_relaxed);
+
+  // pairs with the fence in wake(): either the other side sees the waiter,
+  // or the waiter sees the progress of the other side
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  while (push ? full() : empty()) _cv.wait(lock);
+  _waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// _____________________________________________________________________________
+template <typename T>
+inline void spsc_ring<T>::wake() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!_waiters.load(std::memory_order_relaxed)) return;
+  std::lock_guard<std::mutex> lock(_m);
+  _cv.notify_all();
+}
+
+// _____________________________________________________________________________
+inline run_barrier::run_barrier() : _failed(false), _workers(0), _drained(0) {}
+
+// _____________________________________________________________________________
+inline void run_barrier::reset(size_t workers) {
+  _failed = false;
+  _workers = workers;
+  _drained = 0;
+}
+
+// _____________________________________________________________________________
+inline void run_barrier::fail() {
+  _failed.store(true, std::memory_order_relaxed);
+}
+
+// _____________________________________________________________________________
+inline bool run_barrier::failed() const {
+  return _failed.load(std::memory_order_relaxed);
+}
+
+// _____________________________________________________________________________
+inline bool run_barrier::drained() {
+  std::unique_lock<std::mutex> lock(_m);
+  if (++_drained == _workers) {
+    _cv.notify_all();
+  } else {
+    while (_drained < _workers) _cv.wait(lock);
+  }
+  return !failed();
+}
+
+// _____________________________________________________________________________
+inline event_batch::event_batch() {}
+
+// _____________________________________________________________________________
+inline size_t event_batch::size() const { return _events.size(); }
+
+// _____________________________________________________________________________
+inline size_t event_batch::bytes() const { return _heap.size(); }
+
+// _____________________________________________________________________________
+inline uint32_t event_batch::str(const char* s) {
+  uint32_t off = _heap.size();
+  _heap.insert(_heap.end(), s, s + strlen(s) + 1);
+  return off;
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline void event_batch::add(const F& xml) {
+  const tag& t = xml.get();
+  const attr_map& attrs = t.all_attrs();
+  ev e;
+  e.level = xml.level();
+  e.name = str(t.name);
+  e.text = str(t.text);
+  e.attrs = _attrs.size();
+  e.nattrs = attrs.size();
+  for (const auto& kv : attrs) {
+    uint32_t k = str(kv.first);
+    _attrs.push_back({k, str(kv.second)});
+  }
+  _events.push_back(e);
+}
+
+// _____________________________________________________________________________
+inline void event_batch::replay(consumer* c) const {
+  tag t;
+  const char* heap = _heap.data();
+  for (const auto& e : _events) {
+    t.name = heap + e.name;
+    t.text = heap + e.text;
+    t.attrs.clear();
+    for (size_t i = e.attrs; i < e.attrs + e.nattrs; i++) {
+      t.attrs.push_back({heap + _attrs[i].first, heap + _attrs[i].second});
+    }
+    c->event(t, e.level);
+  }
+}
+
+// _____________________________________________________________________________
+inline fanout::fanout(size_t ring_cap, size_t batch_size)
+    : _ring_cap(ring_cap), _batch_size(batch_size) {}
+
+// _____________________________________________________________________________
+inline fanout::~fanout() {
+  for (auto w : _workers) {
+    delete w->ring;
+    delete w;
+  }
+}
+
+// _____________________________________________________________________________
+inline void fanout::add(consumer* c, bool threaded) {
+  if (!threaded) {
+    _inline.push_back(c);
+    return;
+  }
+
+  worker* w = new worker();
+  w->c = c;
+  w->ring = new spsc_ring<batch_ptr>(_ring_cap);
+  _workers.push_back(w);
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline void fanout::run(F& xml) {
+  _barrier.reset(_workers.size());
+  for (auto w : _workers) {
+    w->exc = std::exception_ptr();
+    w->thread = std::thread(work, w, &_barrier);
+  }
+
+  std::exception_ptr exc;
+
+  try {
+    std::shared_ptr<event_batch> b;
+    if (!_workers.empty()) b = std::make_shared<event_batch>();
+
+    while (xml.next()) {
+      for (auto c : _inline) c->event(xml.get(), xml.level());
+
+      if (!b) continue;
+      b->add(xml);
+      if (b->size() >= _batch_size || b->bytes() >= (1 << 24)) {
+        // stop parsing once a threaded consumer failed
+        if (_barrier.failed()) break;
+        publish(b);
+        b = std::make_shared<event_batch>();
+      }
+    }
+
+    if (b && b->size() && !_barrier.failed()) publish(b);
+  } catch (...) {
+    exc = std::current_exception();
+    _barrier.fail();
+  }
+
+  // a null batch tells the worker to stop
+  for (auto w : _workers) w->ring->push_wait(batch_ptr());
+  for (auto w : _workers) {
+    w->thread.join();
+    if (!exc && w->exc) exc = w->exc;
+  }
+
+  if (exc) std::rethrow_exception(exc);
+
+  for (auto c : _inline) c->finish();
+}
+
+// _____________________________________________________________________________
+inline void fanout::publish(const batch_ptr& b) {
+  for (auto w : _workers) w->ring->push_wait(b);
+}
+
+// _____________________________________________________________________________
+inline void fanout::work(worker* w, run_barrier* barrier) {
+  batch_ptr b;
+  while (true) {
+    w->ring->pop_wait(&b);
+    if (!b) break;
+    // keep draining after a failure, the producer must not block
+    if (barrier->failed()) continue;
+    try {
+      b->replay(w->c);
+    } catch (...) {
+      w->exc = std::current_exception();
+      barrier->fail();
+    }
+  }
+
+  if (!barrier->drained()) return;
+
+  try {
+    w->c->finish();
+  } catch (...) {
+    w->exc = std::current_exception();
+  }
+}
+}  // namespace pfxml
+
+#endif  // PFXML_FANOUT_H_
@@ -0,0 +1,289 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#ifndef PFXML_INDEX_H_
+#define PFXML_INDEX_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+
+namespace pfxml {
+
+// On-disk element index. The builder maps a numeric key attribute (e.g.
+// "id") of all elements with a given name to the byte span of the element in
+// the decompressed input. The index file is a sorted table which is mmap'ed
+// for lookups. All indexed elements must have the same ancestors (e.g.
+// <osm>), the ancestors are stored once in the header and are used to
+// restore a parser state for an element.
+//
+// Layout (native byte order):
+//
+//   char magic[8]           "PFXMLIX1"
+//   uint64_t count          number of entries
+//   uint64_t entries_off    offset of the entry table, 8-byte aligned
+//   uint64_t anc_len        length of the ancestor names
+//   char anc[anc_len]       NUL-terminated ancestor names, outermost first
+//   index_entry entries[count]
+
+static const char INDEX_MAGIC[8] = {'P', 'F', 'X', 'M', 'L', 'I', 'X', '1'};
+
+struct index_entry {
+  int64_t key;
+  int64_t begin;
+  int64_t end;
+};
+
+class index_exc : public std::exception {
+ public:
+  index_exc(std::string msg, std::string file) : _msg(file + ": " + msg) {}
+  ~index_exc() throw() {}
+
+  virtual const char* what() const throw() { return _msg.c_str(); }
+
+ private:
+  std::string _msg;
+};
+
+class index_builder {
+ public:
+  index_builder(const std::string& name, const std::string& key);
+
+  // index all matching elements in xml. Matching elements are skipped
+  // after they were indexed, nested matching elements are thus not indexed.
+  // Throws if a key is not a number
+  template <typename F>
+  void build(F& xml);
+
+  // sort the entries and write the index to path
+  void write(const std::string& path);
+
+  size_t size() const;
+
+ private:
+  std::string _name;
+  std::string _key;
+  std::vector<index_entry> _entries;
+  std::vector<std::string> _anc;
+  size_t _level;
+  bool _sorted;
+
+  static void put(int fd, const void* p, size_t n, const std::string& path);
+};
+
+class element_index {
+ public:
+  explicit element_index(const std::string& path);
+  ~element_index();
+
+  element_index(const element_index&) = delete;
+  element_index& operator=(const element_index&) = delete;
+
+  size_t size() const;
+  const index_entry* begin() const;
+  const index_entry* end() const;
+
+  // the first entry with the given key, or 0 if there is none
+  const index_entry* find(int64_t key) const;
+
+  // a parser state positioned directly before the element of e, to be used
+  // with file::set_state(), after which file::get() returns the element
+  parser_state state(const index_entry& e) const;
+
+ private:
+  std::string _path;
+  void* _map;
+  size_t _map_size;
+  const index_entry* _entries;
+  size_t _count;
+  std::vector<std::string> _anc;
+};
+
+// _____________________________________________________________________________
+inline index_builder::index_builder(const std::string& name,
+                                    const std::string& key)
+    : _name(name), _key(key), _level(0), _sorted(true) {}
+
+// _____________________________________________________________________________
+inline size_t index_builder::size() const { return _entries.size(); }
+
+// _____________________________________________________________________________
+template <typename F>
+inline void index_builder::build(F& xml) {
+  static_assert(F::policy::offsets, "indexing needs the offsets policy switch");
+  while (xml.next()) {
+    const tag& t = xml.get();
+    if (strcmp(t.name, _name.c_str()) != 0) continue;
+    const char* v = t.attr(_key.c_str());
+    if (!v) continue;
+
+    if (!_level) {
+      _level = xml.level();
+      // the state before the current event holds the ancestors, and
+      // possibly elements which were closed directly before the event
+      parser_state st = xml.state();
+      while (st.tag_stack.size() > _level) st.tag_stack.pop();
+      while (!st.tag_stack.empty()) {
+        _anc.insert(_anc.begin(), st.tag_stack.top());
+        st.tag_stack.pop();
+      }
+    } else if (xml.level() != _level) {
+      throw index_exc("indexed elements must have the same ancestors", _name);
+    }
+
+    index_entry e;
+    char* end;
+    errno = 0;
+    e.key = strtoll(v, &end, 10);
+    if (end == v || *end || errno == ERANGE) {
+      throw index_exc(std::string("key '") + v + "' is not a valid integer",
+                      _name);
+    }
+    e.begin = xml.offset();
+    xml.skip();
+    e.end = xml.end_offset();
+
+    if (!_entries.empty() && e.key < _entries.back().key) _sorted = false;
+    _entries.push_back(e);
+  }
+}
+
+// _____________________________________________________________________________
+inline void index_builder::write(const std::string& path) {
+  if (!_sorted) {
+    std::stable_sort(_entries.begin(), _entries.end(),
+                     [](const index_entry& a, const index_entry& b) {
+                       return a.key < b.key;
+                     });
+    _sorted = true;
+  }
+
+  std::string anc;
+  for (const auto& a : _anc) anc.append(a.c_str(), a.size() + 1);
+
+  uint64_t count = _entries.size();
+  uint64_t anc_len = anc.size();
+  uint64_t off = sizeof(INDEX_MAGIC) + 3 * sizeof(uint64_t) + anc_len;
+  off = (off + 7) & ~uint64_t(7);
+
+  std::string hdr(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  hdr.append(reinterpret_cast<const char*>(&count), sizeof(count));
+  hdr.append(reinterpret_cast<const char*>(&off), sizeof(off));
+  hdr.append(reinterpret_cast<const char*>(&anc_len), sizeof(anc_len));
+  hdr.append(anc);
+  hdr.resize(off, 0);
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw index_exc("could not open file", path);
+
+  try {
+    put(fd, hdr.data(), hdr.size(), path);
+    put(fd, _entries.data(), _entries.size() * sizeof(index_entry), path);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+
+  if (close(fd) != 0) throw index_exc("could not close file", path);
+}
+
+// _____________________________________________________________________________
+inline void index_builder::put(int fd, const void* p, size_t n,
+                               const std::string& path) {
+  const char* c = static_cast<const char*>(p);
+  while (n) {
+    ssize_t w = ::write(fd, c, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0) throw index_exc("could not write to file", path);
+    c += w;
+    n -= w;
+  }
+}
+
+// _____________________________________________________________________________
+inline element_index::element_index(const std::string& path)
+    : _path(path), _map(0), _map_size(0), _entries(0), _count(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw index_exc("could not open file", path);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 32) {
+    close(fd);
+    throw index_exc("not a valid index file", path);
+  }
+
+  _map_size = st.st_size;
+  _map = mmap(0, _map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (_map == MAP_FAILED) {
+    _map = 0;
+    throw index_exc("could not map file", path);
+  }
+
+  const char* p = static_cast<const char*>(_map);
+  uint64_t hdr[3];
+  memcpy(hdr, p + sizeof(INDEX_MAGIC), sizeof(hdr));
+  if (memcmp(p, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+      hdr[1] < 32 || hdr[1] > _map_size || hdr[1] % 8 ||
+      hdr[0] > (_map_size - hdr[1]) / sizeof(index_entry) ||
+      hdr[2] > hdr[1] - 32 || (hdr[2] && p[32 + hdr[2] - 1])) {
+    munmap(_map, _map_size);
+    _map = 0;
+    throw index_exc("not a valid index file", path);
+  }
+
+  _count = hdr[0];
+  _entries = reinterpret_cast<const index_entry*>(p + hdr[1]);
+
+  const char* anc = p + 32;
+  for (const char* a = anc; a < anc + hdr[2]; a += strlen(a) + 1) {
+    _anc.push_back(a);
+  }
+}
+
+// _____________________________________________________________________________
+inline element_index::~element_index() {
+  if (_map) munmap(_map, _map_size);
+}
+
+// _____________________________________________________________________________
+inline size_t element_index::size() const { return _count; }
+
+// _____________________________________________________________________________
+inline const index_entry* element_index::begin() const { return _entries; }
+
+// _____________________________________________________________________________
+inline const index_entry* element_index::end() const {
+  return _entries + _count;
+}
+
+// _____________________________________________________________________________
+inline const index_entry* element_index::find(int64_t key) const {
+  const index_entry* e = std::lower_bound(
+      begin(), end(), key,
+      [](const index_entry& a, int64_t k) { return a.key < k; });
+  if (e == end() || e->key != key) return 0;
+  return e;
+}
+
+// _____________________________________________________________________________
+inline parser_state element_index::state(const index_entry& e) const {
+  parser_state st;
+  for (const auto& a : _anc) st.tag_stack.push(a);
+  st.off = e.begin;
+  return st;
+}
+}  // namespace pfxml
+
+#endif  // PFXML_INDEX_H_
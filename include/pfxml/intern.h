@@ -0,0 +1,336 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#ifndef PFXML_INTERN_H_
+#define PFXML_INTERN_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+
+namespace pfxml {
+
+// String interning. An interner maps strings to stable 32-bit ids and back.
+// It is safe to use from multiple threads, the table is split into shards
+// with their own lock. Strings may be admitted only after they were seen a
+// minimum number of times, and the number and length of the stored strings
+// may be capped, strings which are not admitted get the id NO_ID.
+
+static const uint32_t NO_ID = 0xFFFFFFFF;
+
+class intern_exc : public std::exception {
+ public:
+  explicit intern_exc(std::string msg) : _msg(msg) {}
+  ~intern_exc() throw() {}
+
+  virtual const char* what() const throw() { return _msg.c_str(); }
+
+ private:
+  std::string _msg;
+};
+
+class interner {
+ public:
+  // at most max_size strings of at most max_len bytes are stored, a string
+  // is stored once it was seen min_count times
+  explicit interner(size_t max_size = NO_ID, size_t min_count = 1,
+                    size_t max_len = 256);
+  ~interner();
+
+  interner(const interner&) = delete;
+  interner& operator=(const interner&) = delete;
+
+  // the id of s, s is stored if it is admitted. Returns NO_ID otherwise.
+  // Throws if the ids of the shard of s are exhausted
+  uint32_t id(const char* s);
+
+  // the id of s, or NO_ID if s is not stored
+  uint32_t find(const char* s) const;
+
+  // the string with the given id, valid as long as the interner exists
+  const char* str(uint32_t id) const;
+
+  size_t size() const;
+
+ private:
+  static const size_t SHARDS = 64;
+  static const size_t BLOCK_S = 64 * 1024;
+
+  // candidates which were not seen min_count times yet, per shard
+  static const size_t MAX_CANDS = 4096;
+
+  // a string with its hash, which is computed once per lookup. The upper
+  // half of the hash selects the shard
+  struct str_key {
+    const char* s;
+    uint64_t h;
+  };
+
+  struct key_hash {
+    size_t operator()(const str_key& k) const {
+      return static_cast<size_t>(k.h);
+    }
+  };
+
+  struct key_eq {
+    bool operator()(const str_key& a, const str_key& b) const {
+      return a.h == b.h && strcmp(a.s, b.s) == 0;
+    }
+  };
+
+  // a candidate owns a copy of its string, the key points into it
+  struct cand {
+    std::unique_ptr<char[]> str;
+    size_t count;
+  };
+
+  struct shard {
+    mutable std::mutex m;
+    std::unordered_map<str_key, uint32_t, key_hash, key_eq> ids;
+    std::vector<const char*> strs;
+    std::unordered_map<str_key, cand, key_hash, key_eq> cands;
+    std::vector<char*> blocks;
+    size_t block_used;
+    // bucket of the next candidate eviction, see decay()
+    size_t hand;
+  };
+
+  size_t _max_size;
+  size_t _min_count;
+  size_t _max_len;
+  std::atomic<size_t> _size;
+  shard _shards[SHARDS];
+
+  static uint64_t hash(const char* s);
+  static void decay(shard* sh);
+  const char* store(shard* sh, const char* s, size_t len);
+};
+
+// attributes as (key id, value id) pairs
+typedef std::vector<std::pair<uint32_t, uint32_t>> id_attrs;
+
+// wraps a parser and interns element names and attribute keys in keys, and
+// attribute values in vals. Values which are not admitted by vals have the
+// id NO_ID, their strings are still available via get()
+template <typename F>
+class interned {
+ public:
+  interned(F& xml, interner& keys, interner& vals);
+
+  bool next();
+  void skip();
+  size_t level() const;
+
+  // the event of the underlying parser
+  const tag& get() const;
+
+  // the id of the element name, NO_ID for text
+  uint32_t name() const;
+  const id_attrs& attrs() const;
+
+  // the value id of the attribute with the given key id, NO_ID if there is
+  // no such attribute or its value was not admitted
+  uint32_t attr(uint32_t key) const;
+
+ private:
+  F& _xml;
+  interner& _keys;
+  interner& _vals;
+  uint32_t _name;
+  id_attrs _attrs;
+};
+
+// _____________________________________________________________________________
+inline interner::interner(size_t max_size, size_t min_count, size_t max_len)
+    : _max_size(std::min<size_t>(max_size, NO_ID)),
+      _min_count(min_count),
+      _max_len(std::min(max_len, BLOCK_S - 1)),
+      _size(0) {
+  for (auto& sh : _shards) {
+    sh.block_used = BLOCK_S;
+    sh.hand = 0;
+  }
+}
+
+// _____________________________________________________________________________
+inline interner::~interner() {
+  for (auto& sh : _shards) {
+    for (auto b : sh.blocks) delete[] b;
+  }
+}
+
+// _____________________________________________________________________________
+inline uint64_t interner::hash(const char* s) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ull;
+  for (; *s; s++) {
+    h ^= static_cast<unsigned char>(*s);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// _____________________________________________________________________________
+inline uint32_t interner::id(const char* s) {
+  str_key k{s, hash(s)};
+  shard& sh = _shards[(k.h >> 32) % SHARDS];
+  std::lock_guard<std::mutex> lock(sh.m);
+
+  auto it = sh.ids.find(k);
+  if (it != sh.ids.end()) return it->second;
+
+  size_t len = strlen(s);
+  if (len > _max_len) return NO_ID;
+
+  if (_min_count > 1) {
+    // bounded candidate counts, see decay()
+    auto c = sh.cands.find(k);
+    if (c == sh.cands.end()) {
+      if (sh.cands.size() >= MAX_CANDS) decay(&sh);
+      cand n{std::unique_ptr<char[]>(new char[len + 1]), 0};
+      memcpy(n.str.get(), s, len + 1);
+      str_key nk{n.str.get(), k.h};
+      c = sh.cands.emplace(nk, std::move(n)).first;
+    }
+    if (++c->second.count < _min_count) return NO_ID;
+    sh.cands.erase(c);
+  }
+
+  // the ids of a shard are its index plus multiples of SHARDS
+  uint64_t id = static_cast<uint64_t>(sh.strs.size()) * SHARDS;
+  id += &sh - _shards;
+  if (id >= NO_ID) throw intern_exc("no more ids in interner shard");
+
+  if (_size.fetch_add(1) >= _max_size) {
+    _size--;
+    return NO_ID;
+  }
+
+  const char* stored = store(&sh, s, len);
+  sh.strs.push_back(stored);
+  sh.ids[str_key{stored, k.h}] = id;
+  return id;
+}
+
+// _____________________________________________________________________________
+inline uint32_t interner::find(const char* s) const {
+  str_key k{s, hash(s)};
+  const shard& sh = _shards[(k.h >> 32) % SHARDS];
+  std::lock_guard<std::mutex> lock(sh.m);
+  auto it = sh.ids.find(k);
+  if (it == sh.ids.end()) return NO_ID;
+  return it->second;
+}
+
+// _____________________________________________________________________________
+inline const char* interner::str(uint32_t id) const {
+  if (id == NO_ID) return 0;
+  const shard& sh = _shards[id % SHARDS];
+  std::lock_guard<std::mutex> lock(sh.m);
+  if (id / SHARDS >= sh.strs.size()) return 0;
+  return sh.strs[id / SHARDS];
+}
+
+// _____________________________________________________________________________
+inline size_t interner::size() const { return _size; }
+
+// _____________________________________________________________________________
+inline void interner::decay(shard* sh) {
+  // a clock hand sweeps over the buckets, decrements the counts it passes
+  // and removes the candidates which drop to zero, until half of the table
+  // is free. Rare strings make room while frequent ones keep their count
+  while (sh->cands.size() > MAX_CANDS / 2) {
+    size_t b = sh->hand++ % sh->cands.bucket_count();
+    auto it = sh->cands.begin(b);
+    while (it != sh->cands.end(b)) {
+      auto cur = it++;
+      if (cur->second.count > 1) {
+        cur->second.count--;
+      } else {
+        sh->cands.erase(sh->cands.find(cur->first));
+      }
+    }
+  }
+}
+
+// _____________________________________________________________________________
+inline const char* interner::store(shard* sh, const char* s, size_t len) {
+  if (sh->block_used + len + 1 > BLOCK_S) {
+    sh->blocks.push_back(new char[BLOCK_S]);
+    sh->block_used = 0;
+  }
+  char* ret = sh->blocks.back() + sh->block_used;
+  memcpy(ret, s, len + 1);
+  sh->block_used += len + 1;
+  return ret;
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline interned<F>::interned(F& xml, interner& keys, interner& vals)
+    : _xml(xml), _keys(keys), _vals(vals), _name(NO_ID) {}
+
+// _____________________________________________________________________________
+template <typename F>
+inline bool interned<F>::next() {
+  _attrs.clear();
+  _name = NO_ID;
+  if (!_xml.next()) return false;
+
+  const tag& t = _xml.get();
+  if (*t.name) _name = _keys.id(t.name);
+  for (const auto& kv : t.all_attrs()) {
+    _attrs.push_back({_keys.id(kv.first), _vals.id(kv.second)});
+  }
+  return true;
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline void interned<F>::skip() {
+  _xml.skip();
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline size_t interned<F>::level() const {
+  return _xml.level();
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline const tag& interned<F>::get() const {
+  return _xml.get();
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline uint32_t interned<F>::name() const {
+  return _name;
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline const id_attrs& interned<F>::attrs() const {
+  return _attrs;
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline uint32_t interned<F>::attr(uint32_t key) const {
+  for (const auto& kv : _attrs) {
+    if (kv.first == key) return kv.second;
+  }
+  return NO_ID;
+}
+}  // namespace pfxml
+
+#endif  // PFXML_INTERN_H_
@@ -14,10 +14,23 @@
 #include <bzlib.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <map>
+#include <new>
 #include <sstream>
 #include <stack>
 #include <string>
@@ -26,6 +39,11 @@
 namespace pfxml {
 
 static const size_t BUFFER_S = 32 * 1024 * 1024;
+static const size_t INIT_BUFFER_S = 64 * 1024;
+static const size_t PUSH_BUFFER_S = 256 * 1024;
+
+// maximum number of errors kept in the report of the lenient mode
+static const size_t MAX_ERRORS = 1000;
 
 enum state {
   NONE,
@@ -50,6 +68,20 @@ enum state {
   WS_SKIP
 };
 
+// input encodings, everything but UTF8 is transcoded to UTF-8 on input
+enum encoding { UTF8, UTF16LE, UTF16BE, LATIN1, CP1252 };
+
+// file compressions, ZSTD is only supported for output, see writer.h
+enum compression { PLAIN, GZIP, BZIP2, ZSTD };
+
+// code points of the bytes 0x80 to 0x9F in windows-1252, the other bytes
+// are the same as in ISO-8859-1
+static const uint16_t CP1252_HIGH[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178};
+
 // see
 // http://en.wikipedia.org/wiki/List_of_XML_and_HTML_character_entity_references
 static const std::map<std::string, const char*> ENTITIES = {
@@ -323,6 +355,17 @@ class parse_exc : public std::exception {
   std::string _msg;
 };
 
+// an error the parser recovered from in lenient mode. The input in
+// [offset, resumed) was skipped
+struct parse_error {
+  std::string msg;
+  std::string context;  // the input around the error
+  int64_t offset;
+  int64_t resumed;
+};
+
+typedef std::function<void(const parse_error&)> error_handler;
+
 struct parser_state {
   parser_state() : s(NONE), hanging(0), off(0) {}
   std::stack<std::string> tag_stack;
@@ -333,30 +376,254 @@ struct parser_state {
 
 typedef std::vector<std::pair<const char*, const char*>> attr_map;
 
+// a parser buffer. Pinned chunks are not overwritten by the parser, which
+// continues with a fresh chunk instead
+struct chunk {
+  explicit chunk(size_t cap) : buf(new char[cap + 1]), cap(cap), refs(0) {}
+  ~chunk() { delete[] buf; }
+  char* buf;
+  size_t cap;
+  std::atomic<size_t> refs;
+};
+
+// keeps the buffers the strings of an event point into alive. Pins may be
+// released from any thread, but must be released before the file is destroyed
+class chunk_pin {
+ public:
+  chunk_pin() : _c{0, 0} {}
+  chunk_pin(chunk* a, chunk* b);
+  chunk_pin(const chunk_pin& p) = delete;
+  chunk_pin(chunk_pin&& p);
+  ~chunk_pin() { release(); }
+
+  chunk_pin& operator=(const chunk_pin& p) = delete;
+  chunk_pin& operator=(chunk_pin&& p);
+
+  void release();
+
+ private:
+  chunk* _c[2];
+};
+
 struct tag {
   const char* name;
   const char* text;
-  pfxml::attr_map attrs;
+
+  // with a lazy policy, attrs is only filled by attr() or all_attrs()
+  mutable pfxml::attr_map attrs;
+
+  // the untokenized attributes of a start tag with a lazy policy
+  mutable char* lazy = 0;
+  char* lazy_end = 0;
+
   const char* attr(const char* k) const {
-    for (const auto& kv : attrs) {
+    for (const auto& kv : all_attrs()) {
       if (strcmp(kv.first, k) == 0) return kv.second;
     }
     return 0;
   }
+
+  const pfxml::attr_map& all_attrs() const {
+    if (lazy) tokenize();
+    return attrs;
+  }
+
+  void tokenize() const;
+};
+
+// an event whose strings are kept alive by pinning the buffers they point
+// into, see file::retain()
+class retained {
+ public:
+  retained() : _level(0) {}
+
+  const tag& get() const { return _tag; }
+  size_t level() const { return _level; }
+
+  // release the buffers, the strings of get() are invalid afterwards
+  void release() {
+    _pin.release();
+    _tag = tag();
+  }
+
+ private:
+  template <typename P>
+  friend class basic_file;
+  tag _tag;
+  size_t _level;
+  chunk_pin _pin;
+};
+
+// an element or text of a subtree read by file::read_subtree(). The node, its
+// attributes and its strings are stored in an arena
+struct node {
+  const char* name;
+  const char* text;
+  const attr_map::value_type* attrs;
+  size_t nattrs;
+  const node* child;  // first child
+  const node* next;   // next sibling
+  const char* attr(const char* k) const {
+    for (size_t i = 0; i < nattrs; i++) {
+      if (strcmp(attrs[i].first, k) == 0) return attrs[i].second;
+    }
+    return 0;
+  }
+};
+
+// bump allocator for subtrees. clear() frees everything at once, the memory
+// blocks are kept and reused for the next allocations
+class arena {
+ public:
+  explicit arena(size_t block_size = 64 * 1024);
+  ~arena();
+
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+
+  void* alloc(size_t n, size_t align = alignof(std::max_align_t));
+
+  // copy t into a new node without children or siblings
+  node* copy(const tag& t);
+
+  void clear();
+
+ private:
+  size_t _block_s;
+  std::vector<std::pair<char*, size_t>> _blocks;
+  size_t _cur;
+  size_t _used;
+};
+
+// Compile-time parser switches. A policy type is a struct with the following
+// static boolean members (see default_policy):
+//
+//   validate  check closing tags against the open element and reject text
+//             outside of the root element. If false, only the depth is
+//             tracked and the tag stack holds empty names
+//   text      report text nodes. If false, text is skipped
+//   meta      walk comments and processing instructions with full checks.
+//             If false, they are skipped by searching for their end
+//   attrs     tokenize attributes. If false, start tags are skipped up to
+//             their end and tag::attrs stays empty
+//   utf8      check that UTF-8 input is well-formed UTF-8 while it is read.
+//             Transcoded input is always well-formed
+//   lazy      with attrs, only find the end of start tags and tokenize the
+//             attributes on the first call of tag::attr() or
+//             tag::all_attrs(). Attributes are not checked for errors
+//   offsets   track the input offsets of the events, see file::offset()
+struct default_policy {
+  static const bool validate = true;
+  static const bool text = true;
+  static const bool meta = true;
+  static const bool attrs = true;
+  static const bool utf8 = false;
+  static const bool lazy = false;
+  static const bool offsets = false;
+};
+
+// for trusted, machine-generated input where only the element structure
+// matters
+struct trusted_policy {
+  static const bool validate = false;
+  static const bool text = false;
+  static const bool meta = false;
+  static const bool attrs = false;
+  static const bool utf8 = false;
+  static const bool lazy = false;
+  static const bool offsets = false;
 };
 
-class file {
+template <typename P>
+class basic_file {
  public:
-  file(const std::string& path);
-  ~file();
+  typedef P policy;
+
+  // the compression is determined by the file extension (.gz, .bz2) if
+  // not given
+  basic_file(const std::string& path);
+  basic_file(const std::string& path, compression comp);
+
+  // push mode, input is provided via feed(). A single event must fit into
+  // buf_size bytes, a larger event throws
+  explicit basic_file(size_t buf_size = PUSH_BUFFER_S);
+  ~basic_file();
+
+  // rebind the parser to another file, or to a memory block which has to
+  // stay valid until it was parsed. The buffers are reused
+  void open(const std::string& path);
+  void open(const std::string& path, compression comp);
+  void open(const char* data, size_t n);
+
+  // push mode: provide the next n bytes of input. The data is copied into the
+  // parser buffers by next() and has to stay valid until next() returned
+  // false and needs_input() is true
+  void feed(const char* data, size_t n);
+
+  // push mode: signal the end of the input
+  void finish();
+
+  // push mode: true if the last call to next() returned false because
+  // more input has to be fed
+  bool needs_input() const;
+
+  // the encoding of the input, determined from the byte order mark or the
+  // XML declaration. In push mode, it is determined from the first feed
+  encoding input_encoding() const;
 
   const tag& get() const;
 
   bool next();
+  void skip();
   size_t level() const;
+
+  // pin the buffers of the current event, its strings stay valid until the
+  // pin is released
+  chunk_pin pin();
+
+  // keep the current event alive beyond the next call to next()
+  retained retain();
+
+  // read the current element and all of its descendants into a tree in a,
+  // the nodes stay valid until a is cleared. The next call to next() returns
+  // the event following the subtree. In push mode, 0 is returned if more
+  // input is needed, read_subtree() continues the same subtree once it was
+  // fed
+  const node* read_subtree(arena& a);
+
+  // number of buffer refills so far, events with the same number of refills
+  // are covered by the same pin
+  size_t refills() const;
   void reset();
   parser_state state();
   void set_state(const parser_state& s);
+
+  // offsets of the current event in the (decompressed) input, the event
+  // spans [offset(), end_offset()). After skip(), end_offset() is the end of
+  // the skipped element. Only tracked with the offsets policy switch
+  int64_t offset() const;
+  int64_t end_offset() const;
+
+  // number of (decompressed) input bytes read or fed so far
+  int64_t bytes_read() const;
+
+  // lenient mode: syntax errors are reported to handler (if given) instead
+  // of being thrown. The parser skips to the next start tag at a level of at
+  // most level (0: not deeper than the broken element) and continues there.
+  // A closing tag which does not match the open element closes the matching
+  // ancestor, or is ignored if there is none. Missing closing tags at the end
+  // of the input are added. I/O and encoding errors are still thrown
+  void set_lenient(bool lenient, size_t level = 0,
+                   const error_handler& handler = error_handler());
+
+  // lenient mode: the first MAX_ERRORS errors since the last reset, and
+  // their total number
+  const std::vector<parse_error>& errors() const;
+  size_t error_count() const;
+
+  // read the (decompressed) input bytes in [begin, end) without changing
+  // the parser position
+  std::string read_raw(int64_t begin, int64_t end);
   static std::string decode(const char* str);
   static std::string decode(const std::string& str);
 
@@ -372,7 +639,11 @@ class file {
   FILE* _bzfhandle = 0;
   parser_state _s;
   parser_state _prevs;
-  char** _buf;
+  char* _buf[2];
+  chunk* _chunks[2];
+  std::vector<chunk*> _pinned;
+  std::vector<chunk*> _free;
+  size_t _refills;
   char* _c;
   int64_t _last_bytes;
 
@@ -384,18 +655,119 @@ class file {
 
   int64_t _tot_read_bef;
   int64_t _last_new_data;
+  int64_t _bytes_read;
+
+  int64_t _ebeg;
+  int64_t _eend;
+  int64_t _lt;
 
   tag _ret;
 
   bool _gzip;
   bool _bzip;
 
+  bool _push;
+  const char* _feed;
+  size_t _feed_n;
+  bool _eof;
+  bool _partial;
+
+  // state of an unfinished skip()
+  size_t _skip_depth;
+  pfxml::state _skip_st;
+  bool _skip_slash;
+
+  // the current event is returned again by the next call to next()
+  bool _replay;
+
+  // open elements of an unfinished read_subtree(), (node, last child)
+  std::vector<std::pair<node*, node*>> _sub;
+  size_t _sub_lvl;
+
+  // lenient mode
+  bool _lenient;
+  size_t _sync_level;
+  error_handler _on_error;
+  std::vector<parse_error> _errors;
+  size_t _err_count;
+  parse_error _err;
+
+  // skip_scan() looks for the next start tag at a depth of at most _sync_max
+  bool _resync;
+  size_t _sync_max;
+
+  // buffers start small and grow up to this size
+  size_t _max_buf;
+
+  // memory input
+  const char* _mem;
+  size_t _mem_n;
+
+  encoding _enc;
+  bool _detect;
+
+  // input which was read but not yet transcoded
+  std::vector<char> _raw;
+  size_t _raw_beg;
+  size_t _raw_end;
+  bool _raw_eof;
+
+  // transcoded input in push mode
+  std::vector<char> _dec;
+
+  // state of the UTF-8 check
+  size_t _u8_need;
+  unsigned char _u8_lo;
+  unsigned char _u8_hi;
+  int64_t _u8_off;
+
+  void close_input();
+  void release();
+  void grow(size_t i);
+  int64_t read_bytes(char* buf, size_t n);
+  int64_t fill(char* buf, size_t n);
+  size_t detect(const char* p, size_t n);
+  size_t transcode(const char* in, size_t n, char* out, size_t out_n,
+                   size_t* used, bool last);
+  void check_utf8(const char* p, size_t n);
+#ifdef __SSSE3__
+  static const unsigned char* check_utf8_blocks(const unsigned char* s,
+                                                const unsigned char* e,
+                                                bool* ok);
+#endif
+  bool refill(size_t off);
+  void rebase(const char* beg, char* dst);
+  bool append();
+  bool skip_scan();
+  void unpin(size_t i);
+  void push_tag();
+  void seek(int64_t off);
+  int64_t pos(const char* p) const;
+
+  bool error(const std::string& msg, pfxml::state st);
+  void close_wrong();
+  void record(const std::string& msg);
+  void report();
+  void resynced(size_t depth, int64_t off);
+  std::string context() const;
+
   static size_t utf8(size_t cp, char* out);
+  static compression compression_of(const std::string& path);
+  static char* tag_end(char* p, char* end);
+  static bool in_start_tag(pfxml::state s);
   const char* empty_str = "";
 };
 
+typedef basic_file<default_policy> file;
+
+// _____________________________________________________________________________
+template <typename P>
+inline basic_file<P>::basic_file(const std::string& path)
+    : basic_file(path, compression_of(path)) {}
+
 // _____________________________________________________________________________
-inline file::file(const std::string& path)
+template <typename P>
+inline basic_file<P>::basic_file(const std::string& path, compression comp)
     : _file(0),
 #ifndef PFXML_NO_ZLIB
       _gzfile(Z_NULL),
@@ -403,90 +775,215 @@ inline file::file(const std::string& path)
 #ifndef PFXML_NO_BZLIB
       _bzfile(0),
 #endif
+      _refills(0),
       _c(0),
       _last_bytes(0),
       _which(0),
       _path(path),
       _tot_read_bef(0),
+      _bytes_read(0),
+      _ebeg(0),
+      _eend(0),
+      _lt(0),
       _gzip(false),
-      _bzip(false) {
-  _buf = new char*[2];
-  _buf[0] = new char[BUFFER_S + 1];
-  _buf[1] = new char[BUFFER_S + 1];
-
-  if (path.size() > 2 && path[path.size() - 1] == 'z' &&
-      path[path.size() - 2] == 'g' && path[path.size() - 3] == '.') {
-    _gzip = true;
+      _bzip(false),
+      _push(false),
+      _feed(0),
+      _feed_n(0),
+      _eof(false),
+      _partial(false),
+      _skip_depth(0),
+      _replay(false),
+      _lenient(false),
+      _sync_level(0),
+      _max_buf(BUFFER_S),
+      _mem(0),
+      _mem_n(0) {
+  _chunks[0] = new chunk(INIT_BUFFER_S);
+  _chunks[1] = new chunk(INIT_BUFFER_S);
+  _buf[0] = _chunks[0]->buf;
+  _buf[1] = _chunks[1]->buf;
+
+  try {
+    open(path, comp);
+  } catch (...) {
+    // the destructor does not run if the constructor throws
+    release();
+    throw;
   }
+}
 
-  if (path.size() > 3 && path[path.size() - 1] == '2' &&
-      path[path.size() - 2] == 'z' && path[path.size() - 3] == 'b' &&
-      path[path.size() - 4] == '.') {
-    _bzip = true;
-  }
+// _____________________________________________________________________________
+template <typename P>
+inline basic_file<P>::basic_file(size_t buf_size)
+    : _file(0),
+#ifndef PFXML_NO_ZLIB
+      _gzfile(Z_NULL),
+#endif
+#ifndef PFXML_NO_BZLIB
+      _bzfile(0),
+#endif
+      _refills(0),
+      _c(0),
+      _last_bytes(0),
+      _which(0),
+      _path("[push]"),
+      _tot_read_bef(0),
+      _bytes_read(0),
+      _ebeg(0),
+      _eend(0),
+      _lt(0),
+      _gzip(false),
+      _bzip(false),
+      _push(true),
+      _feed(0),
+      _feed_n(0),
+      _eof(false),
+      _partial(false),
+      _skip_depth(0),
+      _replay(false),
+      _lenient(false),
+      _sync_level(0),
+      _max_buf(buf_size),
+      _mem(0),
+      _mem_n(0) {
+  _chunks[0] = new chunk(buf_size);
+  _chunks[1] = new chunk(buf_size);
+  _buf[0] = _chunks[0]->buf;
+  _buf[1] = _chunks[1]->buf;
 
   reset();
 }
 
 // _____________________________________________________________________________
-inline file::~file() {
-  delete[] _buf[0];
-  delete[] _buf[1];
-  delete[] _buf;
-  if (_gzip) {
+template <typename P>
+inline basic_file<P>::~basic_file() { release(); }
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::release() {
+  delete _chunks[0];
+  delete _chunks[1];
+  for (auto c : _pinned) delete c;
+  for (auto c : _free) delete c;
+  close_input();
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::close_input() {
 #ifndef PFXML_NO_ZLIB
-    if (_gzfile != Z_NULL) {
-      gzclose(_gzfile);
-      _gzfile = Z_NULL;
-    }
+  if (_gzfile != Z_NULL) {
+    gzclose(_gzfile);
+    _gzfile = Z_NULL;
+  }
 #endif
-  } else if (_bzip) {
 #ifndef PFXML_NO_BZLIB
-    if (_bzfile) {
-      int err;
-      BZ2_bzReadClose(&err, _bzfile);
-      _bzfile = nullptr;
-    }
+  if (_bzfile) {
+    int err;
+    BZ2_bzReadClose(&err, _bzfile);
+    _bzfile = nullptr;
+  }
 #endif
-    if (_bzfhandle) fclose(_bzfhandle);
-  } else {
+  if (_bzfhandle) {
+    fclose(_bzfhandle);
+    _bzfhandle = 0;
+  }
+  if (_file > 0) {
     close(_file);
+    _file = 0;
+  }
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::open(const std::string& path) {
+  open(path, compression_of(path));
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::open(const std::string& path, compression comp) {
+  close_input();
+  _path = path;
+  _push = false;
+  _mem = 0;
+  _mem_n = 0;
+  _max_buf = BUFFER_S;
+  _gzip = comp == GZIP;
+  _bzip = comp == BZIP2;
+
+  if (comp == ZSTD) {
+    throw parse_exc("zstd input is not supported", _path, 0, 0, 0);
+  }
+
+  reset();
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline compression basic_file<P>::compression_of(const std::string& path) {
+  if (path.size() > 2 && path[path.size() - 1] == 'z' &&
+      path[path.size() - 2] == 'g' && path[path.size() - 3] == '.') {
+    return GZIP;
+  }
+
+  if (path.size() > 3 && path[path.size() - 1] == '2' &&
+      path[path.size() - 2] == 'z' && path[path.size() - 3] == 'b' &&
+      path[path.size() - 4] == '.') {
+    return BZIP2;
   }
+
+  return PLAIN;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::open(const char* data, size_t n) {
+  close_input();
+  _path = "[memory]";
+  _push = true;
+  _mem = data;
+  _mem_n = n;
+  _max_buf = BUFFER_S;
+  _gzip = false;
+  _bzip = false;
+
+  reset();
 }
 
 // _____________________________________________________________________________
-inline void file::reset() {
+template <typename P>
+inline void basic_file<P>::reset() {
   _which = 0;
   _s.s = NONE;
   _s.hanging = 0;
   _tot_read_bef = 0;
-
-  if (_file) {
-    if (_gzip) {
-#ifndef PFXML_NO_ZLIB
-      if (_gzfile != Z_NULL) {
-        gzclose(_gzfile);
-        _gzfile = Z_NULL;
-      }
-#endif
-    } else if (_bzip) {
-#ifndef PFXML_NO_BZLIB
-      if (_bzfile) {
-        int err;
-        BZ2_bzReadClose(&err, _bzfile);
-        _bzfile = nullptr;
-      }
-      if (_bzfhandle) {
-        fclose(_bzfhandle);
-        _bzfhandle = 0;
-      }
-#endif
-    } else {
-      close(_file);
-    }
-  }
-
-  if (_gzip) {
+  _bytes_read = 0;
+  _feed = 0;
+  _feed_n = 0;
+  _eof = false;
+  _partial = false;
+  _skip_depth = 0;
+  _replay = false;
+  _sub.clear();
+  _errors.clear();
+  _err_count = 0;
+  _resync = false;
+  _enc = UTF8;
+  _detect = true;
+  _raw.clear();
+  _raw_beg = 0;
+  _raw_end = 0;
+  _raw_eof = false;
+  _u8_need = 0;
+  _u8_off = 0;
+
+  close_input();
+
+  if (_push) {
+    // input is fed
+  } else if (_gzip) {
 #ifndef PFXML_NO_ZLIB
     _gzfile = gzopen(_path.c_str(), "r");
     if (_gzfile == Z_NULL)
@@ -514,51 +1011,71 @@ inline void file::reset() {
                     _path, 0, 0, 0);
 #endif
   } else {
-    _file = open(_path.c_str(), O_RDONLY);
+    _file = ::open(_path.c_str(), O_RDONLY);
     if (_file < 0)
       throw parse_exc(std::string("could not open file"), _path, 0, 0, 0);
   }
 
-  if (!_gzip && !_bzip) {
+  if (!_gzip && !_bzip && !_push) {
 #ifdef __unix__
     posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
   }
 
-  if (_gzip) {
-#ifndef PFXML_NO_ZLIB
-    _last_bytes = gzread(_gzfile, _buf[_which], BUFFER_S);
-#endif
-  } else if (_bzip) {
-#ifndef PFXML_NO_BZLIB
-    int err;
-    _last_bytes = BZ2_bzRead(&err, _bzfile, _buf[_which], BUFFER_S);
-#endif
-  } else {
-    _last_bytes = read(_file, _buf[_which], BUFFER_S);
-  }
-
+  unpin(_which);
+  _last_bytes = fill(_buf[_which], _chunks[_which]->cap);
   _last_new_data = _last_bytes;
   _c = _buf[_which];
   while (!_s.tag_stack.empty()) _s.tag_stack.pop();
   _s.tag_stack.push("[root]");
   _prevs = _s;
+
+  if (_mem) {
+    _eof = true;
+    feed(_mem, _mem_n);
+    finish();
+  }
 }
 
 // _____________________________________________________________________________
-inline size_t file::level() const { return _s.tag_stack.size() - _s.hanging; }
+template <typename P>
+inline size_t basic_file<P>::level() const {
+  return _s.tag_stack.size() - _s.hanging;
+}
 
 // _____________________________________________________________________________
-inline parser_state file::state() { return _prevs; }
+template <typename P>
+inline parser_state basic_file<P>::state() { return _prevs; }
 
 // _____________________________________________________________________________
-inline void file::set_state(const parser_state& s) {
+template <typename P>
+inline void basic_file<P>::set_state(const parser_state& s) {
+  _replay = false;
+  _sub.clear();
+  _resync = false;
+  _skip_depth = 0;
   _s = s;
   _prevs = s;
+  unpin(_which);
+  seek(_s.off);
 
-  if (_gzip) {
+  _last_bytes = fill(_buf[_which], _chunks[_which]->cap);
+  _last_new_data = _last_bytes;
+  _c = _buf[_which];
+
+  next();
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::seek(int64_t off) {
+  if (_push) {
+    throw parse_exc("Cannot seek in push mode", _path, 0, 0, 0);
+  } else if (_enc != UTF8) {
+    throw parse_exc("Cannot seek in transcoded input", _path, 0, 0, 0);
+  } else if (_gzip) {
 #ifndef PFXML_NO_ZLIB
-    gzseek(_gzfile, _s.off, SEEK_SET);
+    gzseek(_gzfile, off, SEEK_SET);
 #endif
   } else if (_bzip) {
 #ifndef PFXML_NO_BZLIB
@@ -587,82 +1104,140 @@ inline void file::set_state(const parser_state& s) {
 
     int64_t readSoFar = 0;
 
+    // the parser buffers may still be referenced by the current event
+    const int64_t skip_s = 1024 * 1024;
+    std::vector<char> skip(skip_s);
     while (err == BZ_OK) {
       int readb;
-      if (readSoFar + int64_t(BUFFER_S) > _s.off) {
-        readb = BZ2_bzRead(&err, _bzfile, _buf[_which], _s.off - readSoFar);
+      if (readSoFar + skip_s > off) {
+        readb = BZ2_bzRead(&err, _bzfile, skip.data(), off - readSoFar);
       } else {
-        readb = BZ2_bzRead(&err, _bzfile, _buf[_which], BUFFER_S);
+        readb = BZ2_bzRead(&err, _bzfile, skip.data(), skip_s);
       }
       if (readb == 0) break;
       readSoFar += readb;
     }
-    assert(readSoFar == _s.off);
+    assert(readSoFar == off);
 #endif
   } else {
-    lseek(_file, _s.off, SEEK_SET);
+    lseek(_file, off, SEEK_SET);
   }
-  _tot_read_bef = _s.off;
+  _tot_read_bef = off;
+  _raw_beg = 0;
+  _raw_end = 0;
+  _raw_eof = false;
+  _u8_need = 0;
+  _u8_off = off;
+}
 
-  if (_gzip) {
-#ifndef PFXML_NO_ZLIB
-    _last_bytes = gzread(_gzfile, _buf[_which], BUFFER_S);
-#endif
-  } else if (_bzip) {
-#ifndef PFXML_NO_BZLIB
-    int err;
-    _last_bytes = BZ2_bzRead(&err, _bzfile, _buf[_which], BUFFER_S);
-#endif
-  } else {
-    _last_bytes = read(_file, _buf[_which], BUFFER_S);
+// _____________________________________________________________________________
+template <typename P>
+inline std::string basic_file<P>::read_raw(int64_t begin, int64_t end) {
+  int64_t bef = _tot_read_bef;
+  int64_t bytes = _bytes_read;
+  int64_t cur = _tot_read_bef + _last_new_data;
+
+  std::string ret(end - begin, 0);
+  seek(begin);
+  int64_t got = 0;
+  while (got < end - begin) {
+    int64_t readb = read_bytes(&ret[got], end - begin - got);
+    if (readb <= 0) break;
+    got += readb;
   }
-  _last_new_data = _last_bytes;
-  _c = _buf[_which];
+  ret.resize(got);
 
-  next();
+  // continue reading where the parser stopped
+  seek(cur);
+  _tot_read_bef = bef;
+  _bytes_read = bytes;
+  return ret;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline int64_t basic_file<P>::offset() const { return _ebeg; }
+
+// _____________________________________________________________________________
+template <typename P>
+inline int64_t basic_file<P>::end_offset() const { return _eend; }
+
+// _____________________________________________________________________________
+template <typename P>
+inline int64_t basic_file<P>::bytes_read() const { return _bytes_read; }
+
+// _____________________________________________________________________________
+template <typename P>
+inline int64_t basic_file<P>::pos(const char* p) const {
+  return _tot_read_bef + (p - _buf[_which]) - (_last_bytes - _last_new_data);
 }
 
 // _____________________________________________________________________________
-inline const tag& file::get() const { return _ret; }
+template <typename P>
+inline const tag& basic_file<P>::get() const { return _ret; }
 
 // _____________________________________________________________________________
-inline bool file::next() {
+template <typename P>
+inline bool basic_file<P>::next() {
+  if (_replay) {
+    _replay = false;
+    return true;
+  }
+
   if (!_s.tag_stack.size()) return false;
-  // avoid too much stack copying
-  if (_prevs.tag_stack.size() != _s.tag_stack.size() ||
-      _prevs.tag_stack.top() != _s.tag_stack.top()) {
-    _prevs.tag_stack = _s.tag_stack;
+
+  // finish a skip() or a resync which ran out of input
+  if ((_skip_depth || _resync) && !skip_scan()) return false;
+
+  if (_partial) {
+    // continue an event which ran out of input in push mode
+    _partial = false;
+  } else {
+    // avoid too much stack copying
+    if (_prevs.tag_stack.size() != _s.tag_stack.size() ||
+        _prevs.tag_stack.top() != _s.tag_stack.top()) {
+      _prevs.tag_stack = _s.tag_stack;
+    }
+    _prevs.s = _s.s;
+    _prevs.hanging = _s.hanging;
+    _prevs.off = pos(_c);
+
+    if (_s.hanging) _s.hanging--;
+    _ret.name = 0;
+    _ret.text = empty_str;
+    _ret.attrs.clear();
+    _ret.lazy = 0;
   }
-  _prevs.s = _s.s;
-  _prevs.hanging = _s.hanging;
-  _prevs.off =
-      _tot_read_bef + (_c - _buf[_which]) - (_last_bytes - _last_new_data);
-
-  if (_s.hanging) _s.hanging--;
-  _ret.name = 0;
-  _ret.text = empty_str;
-  _ret.attrs.clear();
   void* i;
-  while (_last_bytes) {
+
+  // the state is kept in a local while scanning, which the compiler can keep
+  // in a register
+  pfxml::state st = _s.s;
+  while (true) {
     for (; _c - _buf[_which] < _last_bytes; ++_c) {
       char c = *_c;
-      switch (_s.s) {
+      switch (st) {
         case NONE:
           if (std::isspace(c))
             continue;
           else if (c == '<') {
-            _s.s = IN_TAG_TENTATIVE;
+            st = IN_TAG_TENTATIVE;
+            if (P::offsets) _lt = pos(_c);
             continue;
           }
-          _s.s = IN_TEXT;
-          _ret.name = empty_str;
-          _tmp = _c;
+          st = IN_TEXT;
+          if (P::text) {
+            _ret.name = empty_str;
+            _tmp = _c;
+            if (P::offsets) _ebeg = pos(_c);
+          }
           continue;
 
         case IN_TEXT:
-          if (_s.tag_stack.size() == 1) {
-            throw parse_exc("No text allowed here.", _path, _c, _buf[_which],
-                            _prevs.off);
+          if (P::validate && _s.tag_stack.size() == 1) {
+            if (!error("No text allowed here.", NONE)) return false;
+            st = _s.s;
+            continue;
           }
           i = memchr(_c, '<', _last_bytes - (_c - _buf[_which]));
           if (!i) {
@@ -670,42 +1245,60 @@ inline bool file::next() {
             continue;
           }
           _c = (char*)i;
+          if (!P::text) {
+            st = IN_TAG_TENTATIVE;
+            if (P::offsets) _lt = pos(_c);
+            continue;
+          }
           *_c = 0;
           _ret.text = _tmp;
-          _s.s = IN_TAG_TENTATIVE;
+          st = IN_TAG_TENTATIVE;
+          if (P::offsets) _eend = _lt = pos(_c);
           _c++;
+          _s.s = st;
           return true;
 
         case IN_COMMENT_TENTATIVE:
           if (c == '-') {
-            _s.s = IN_COMMENT_TENTATIVE2;
+            st = IN_COMMENT_TENTATIVE2;
+            continue;
+          }
+          if (!P::meta) {
+            // skip declarations other than comments up to their end
+            st = c == '>' ? NONE : IN_TAG_NAME_META;
             continue;
           }
-          throw parse_exc("Expected comment", _path, _c, _buf[_which],
-                          _prevs.off);
+          if (!error("Expected comment", IN_TAG_NAME_META)) return false;
+          st = _s.s;
+          continue;
 
         case IN_COMMENT_TENTATIVE2:
           if (c == '-') {
-            _s.s = IN_COMMENT;
+            st = IN_COMMENT;
+            continue;
+          }
+          if (!P::meta) {
+            st = c == '>' ? NONE : IN_TAG_NAME_META;
             continue;
           }
-          throw parse_exc("Expected comment", _path, _c, _buf[_which],
-                          _prevs.off);
+          if (!error("Expected comment", IN_TAG_NAME_META)) return false;
+          st = _s.s;
+          continue;
 
         case IN_COMMENT_CL_TENTATIVE:
           if (c == '-') {
-            _s.s = IN_COMMENT_CL_TENTATIVE2;
+            st = IN_COMMENT_CL_TENTATIVE2;
             continue;
           }
-          _s.s = IN_COMMENT;
+          st = IN_COMMENT;
           continue;
 
         case IN_COMMENT_CL_TENTATIVE2:
           if (c == '>') {
-            _s.s = NONE;
+            st = NONE;
             continue;
           }
-          _s.s = IN_COMMENT;
+          st = IN_COMMENT;
           // fall through, we are still in comment
 
         case IN_COMMENT:
@@ -715,44 +1308,71 @@ inline bool file::next() {
             continue;
           }
           _c = (char*)i;
-          _s.s = IN_COMMENT_CL_TENTATIVE;
+          st = IN_COMMENT_CL_TENTATIVE;
           continue;
 
         case IN_TAG_TENTATIVE:
-          if (c == '/') {
-            _s.s = IN_TAG_NAME_CLOSE;
+          if (!P::validate && c == '/') {
+            st = IN_TAG_CLOSE;
+            continue;
+          } else if (c == '/') {
+            st = IN_TAG_NAME_CLOSE;
             _tmp = _c + 1;
             continue;
           } else if (c == '?') {
-            _s.s = IN_TAG_NAME_META;
+            st = IN_TAG_NAME_META;
             continue;
           } else if (c == '!') {
-            _s.s = IN_COMMENT_TENTATIVE;
+            st = IN_COMMENT_TENTATIVE;
             continue;
           } else if (std::isalnum(c) || c == '-' || c == '_' || c == '.') {
-            _s.s = IN_TAG_NAME;
+            st = IN_TAG_NAME;
             _ret.name = _c;
             continue;
           }
+          // a stray '<', the scan resumes right after it so that the next
+          // tag is seen (the current char might start it)
+          if (!error("Expected valid tag", NONE)) return false;
+          st = _s.s;
+          continue;
 
         case IN_TAG:
+          if (!P::attrs || P::lazy) {
+            // skip to the next quote or the end of the tag
+            _c = tag_end(_c, _buf[_which] + _last_bytes);
+            if (_c - _buf[_which] == _last_bytes) continue;
+            c = *_c;
+            if (c == '"') {
+              st = IN_ATTRVAL_DQ;
+              continue;
+            } else if (c == '\'') {
+              st = IN_ATTRVAL_SQ;
+              continue;
+            }
+            if (P::lazy) _ret.lazy_end = _c;
+          }
           if (std::isspace(c))
             continue;
           else if (std::isalnum(c) || c == '-' || c == '_' || c == '.') {
-            _s.s = IN_ATTRKEY;
+            st = IN_ATTRKEY;
             _tmp = _c;
             continue;
           } else if (c == '/') {
-            _s.s = AW_CLOSING;
+            st = AW_CLOSING;
             continue;
           } else if (c == '>') {
             _s.hanging++;
-            _s.tag_stack.push(_ret.name);
-            _s.s = WS_SKIP;
+            push_tag();
+            st = WS_SKIP;
+            if (P::offsets) {
+              _ebeg = _lt;
+              _eend = pos(_c) + 1;
+            }
             continue;
           }
-          throw parse_exc("Expected valid tag", _path, _c, _buf[_which],
-                          _prevs.off);
+          if (!error("Expected valid tag", IN_TAG)) return false;
+          st = _s.s;
+          continue;
 
         case IN_ATTRVAL_SQ:
           i = memchr(_c, '\'', _last_bytes - (_c - _buf[_which]));
@@ -761,7 +1381,8 @@ inline bool file::next() {
             continue;
           }
           _c = (char*)i;
-          _s.s = IN_TAG;
+          st = IN_TAG;
+          if (!P::attrs || P::lazy) continue;
           *_c = 0;
           _ret.attrs.push_back({_tmp, _tmp2});
           continue;
@@ -773,7 +1394,8 @@ inline bool file::next() {
             continue;
           }
           _c = (char*)i;
-          _s.s = IN_TAG;
+          st = IN_TAG;
+          if (!P::attrs || P::lazy) continue;
           *_c = 0;
           _ret.attrs.push_back({_tmp, _tmp2});
           continue;
@@ -782,67 +1404,86 @@ inline bool file::next() {
           if (std::isspace(c))
             continue;
           else if (c == '\'') {
-            _s.s = IN_ATTRVAL_SQ;
+            st = IN_ATTRVAL_SQ;
             _tmp2 = _c + 1;
             continue;
           } else if (c == '"') {
-            _s.s = IN_ATTRVAL_DQ;
+            st = IN_ATTRVAL_DQ;
             _tmp2 = _c + 1;
             continue;
           }
-          throw parse_exc("Expected attribute value", _path, _c, _buf[_which],
-                          _prevs.off);
+          if (!error("Expected attribute value", IN_TAG)) return false;
+          st = _s.s;
+          continue;
 
         case IN_ATTRKEY:
           if (std::isspace(c)) {
             *_c = 0;
-            _s.s = AFTER_ATTRKEY;
+            st = AFTER_ATTRKEY;
             continue;
           } else if (std::isalnum(c) || c == '-' || c == '_' || c == '.') {
             continue;
           } else if (c == '=') {
             *_c = 0;
-            _s.s = AW_IN_ATTRVAL;
+            st = AW_IN_ATTRVAL;
             continue;
           }
 
-          throw parse_exc("Expected attribute key char or =", _path, _c,
-                          _buf[_which], _prevs.off);
+          if (!error("Expected attribute key char or =", IN_TAG)) return false;
+          st = _s.s;
+          continue;
 
         case AFTER_ATTRKEY:
           if (std::isspace(c))
             continue;
           else if (c == '=') {
-            _s.s = AW_IN_ATTRVAL;
+            st = AW_IN_ATTRVAL;
             continue;
           }
-          throw parse_exc(
-              std::string("Expected attribute value for '") + _tmp + "'.",
-              _path, _c, _buf[_which], _prevs.off);
+          if (!error(std::string("Expected attribute value for '") + _tmp +
+                         "'.",
+                     IN_TAG)) {
+            return false;
+          }
+          st = _s.s;
+          continue;
 
         case IN_TAG_NAME:
           if (std::isspace(c)) {
             *_c = 0;
-            _s.s = IN_TAG;
+            st = IN_TAG;
+            if (P::lazy) _ret.lazy = _c + 1;
             continue;
           } else if (c == '>') {
             *_c = 0;
             _s.hanging++;
-            _s.tag_stack.push(_ret.name);
-            _s.s = WS_SKIP;
+            push_tag();
+            st = WS_SKIP;
+            if (P::offsets) {
+              _ebeg = _lt;
+              _eend = pos(_c) + 1;
+            }
             continue;
           } else if (c == '/') {
             *_c = 0;
-            _s.s = AW_CLOSING;
-            continue;
-          } else if (std::isalnum(c) || c == '-' || c == '_' || c == '.') {
+            st = AW_CLOSING;
             continue;
           }
+          continue;
 
         case IN_TAG_NAME_META:
-          // TODO: read meta tags!
+          // the encoding of the XML declaration was already read by detect()
+          if (!P::meta) {
+            i = memchr(_c, '>', _last_bytes - (_c - _buf[_which]));
+            if (!i) {
+              _c = _buf[_which] + _last_bytes;
+              continue;
+            }
+            _c = (char*)i;
+            c = '>';
+          }
           if (c == '>') {
-            _s.s = NONE;
+            st = NONE;
             continue;
           }
 
@@ -851,42 +1492,56 @@ inline bool file::next() {
         case IN_TAG_NAME_CLOSE:
           if (std::isspace(c)) {
             *_c = 0;
-            _s.s = IN_TAG_CLOSE;
+            st = IN_TAG_CLOSE;
             continue;
           } else if (std::isalnum(c) || c == '-' || c == '_' || c == '.') {
             continue;
           } else if (c == '>') {
             *_c = 0;
             if (_tmp != _s.tag_stack.top()) {
-              throw parse_exc(std::string("Closing wrong tag '<") + _tmp +
-                                  ">', expected close of '<" +
-                                  _s.tag_stack.top() + ">'.",
-                              _path, _c, _buf[_which], _prevs.off);
+              close_wrong();
+            } else {
+              _s.tag_stack.pop();
             }
-            _s.tag_stack.pop();
-            _s.s = NONE;
+            st = NONE;
             continue;
           }
 
         case IN_TAG_CLOSE:
+          if (!P::validate) {
+            // only track the depth
+            i = memchr(_c, '>', _last_bytes - (_c - _buf[_which]));
+            if (!i) {
+              _c = _buf[_which] + _last_bytes;
+              continue;
+            }
+            _c = (char*)i;
+            _s.tag_stack.pop();
+            st = NONE;
+            continue;
+          }
           if (std::isspace(c))
             continue;
           else if (c == '>') {
             if (_tmp != _s.tag_stack.top()) {
-              throw parse_exc(std::string("Closing wrong tag '<") + _tmp +
-                                  ">', expected close of '<" +
-                                  _s.tag_stack.top() + ">'.",
-                              _path, _c, _buf[_which], _prevs.off);
+              close_wrong();
+            } else {
+              _s.tag_stack.pop();
             }
-            _s.tag_stack.pop();
-            _s.s = NONE;
+            st = NONE;
             continue;
           }
-          throw parse_exc("Expected '>'", _path, _c, _buf[_which], _prevs.off);
+          if (!error("Expected '>'", IN_TAG_CLOSE)) return false;
+          st = _s.s;
+          continue;
 
         case AW_CLOSING:
           if (c == '>') {
-            _s.s = WS_SKIP;
+            st = WS_SKIP;
+            if (P::offsets) {
+              _ebeg = _lt;
+              _eend = pos(_c) + 1;
+            }
             continue;
           }
 
@@ -897,50 +1552,50 @@ inline bool file::next() {
       }
     }
 
+    _s.s = st;
+    if (_push) {
+      _c = _buf[_which] + _last_bytes;
+      if (append()) continue;
+      if (!_feed_n && !_eof) {
+        _partial = true;
+        return false;
+      }
+    }
+
     // buffer ended, read new stuff, but copy remaining if needed
+    unpin(!_which);
+    grow(!_which);
     size_t off = 0;
-    if (_s.s == IN_TAG_NAME) {  //|| IN_TAG_NAME_META) {
-      off = _last_bytes - (_ret.name - _buf[_which]);
-      memmove(_buf[!_which], _ret.name, off);
-      _ret.name = _buf[!_which];
-    } else if (_s.s == IN_TAG_NAME_CLOSE || _s.s == IN_ATTRKEY ||
-               _s.s == IN_TEXT) {
+    if (in_start_tag(_s.s)) {
+      // the name and the attributes read so far point into the open start
+      // tag, which is carried over in one piece, as its buffer is reused or
+      // freed by grow() on the next refill
+      const char* beg = _ret.name;
+      off = _last_bytes - (beg - _buf[_which]);
+      memmove(_buf[!_which], beg, off);
+      rebase(beg, _buf[!_which]);
+    } else if (_s.s == IN_TAG_NAME_CLOSE ||
+               (P::validate && _s.s == IN_TAG_CLOSE) ||
+               (P::text && _s.s == IN_TEXT)) {
       off = _last_bytes - (_tmp - _buf[_which]);
       memmove(_buf[!_which], _tmp, off);
       _tmp = _buf[!_which];
-    } else if (_s.s == IN_ATTRVAL_SQ || _s.s == IN_ATTRVAL_DQ) {
-      off = _last_bytes - (_tmp2 - _buf[_which]);
-      memmove(_buf[!_which], _tmp2, off);
-      _tmp2 = _buf[!_which];
     }
 
-    assert(off <= BUFFER_S);
+    assert(off <= _chunks[_which]->cap);
 
-    size_t readb = 0;
-    if (_gzip) {
-#ifndef PFXML_NO_ZLIB
-      readb = gzread(_gzfile, _buf[!_which] + off, BUFFER_S - off);
-#endif
-    } else if (_bzip) {
-#ifndef PFXML_NO_BZLIB
-      int err;
-      readb = BZ2_bzRead(&err, _bzfile, _buf[!_which] + off, BUFFER_S - off);
-#endif
-    } else {
-      readb = read(_file, _buf[!_which] + off, BUFFER_S - off);
-    }
-    if (!readb) break;
-    _tot_read_bef += _last_new_data;
-    _which = !_which;
-    _last_new_data = readb;
-    _last_bytes = _last_new_data + off;
-    _c = _buf[_which] + off;
+    if (!refill(off)) break;
   }
 
   if (_s.tag_stack.size()) {
     if (_s.tag_stack.top() != "[root]") {
-      throw parse_exc("XML tree not complete", _path, _c, _buf[_which],
-                      _prevs.off);
+      if (!_lenient) {
+        throw parse_exc("XML tree not complete", _path, _c, _buf[_which],
+                        _prevs.off);
+      }
+      _c = _buf[_which] + _last_bytes;
+      record("XML tree not complete");
+      resynced(0, pos(_c));
     }
     _s.tag_stack.pop();
   }
@@ -950,12 +1605,1090 @@ inline bool file::next() {
 }
 
 // _____________________________________________________________________________
-inline std::string file::decode(const std::string& str) {
+template <typename P>
+inline void basic_file<P>::skip() {
+  // only an opening tag which was just returned by next() has a subtree
+  if (!_s.hanging) return;
+
+  _skip_depth = 1;
+  _skip_slash = false;
+  _skip_st = NONE;
+  skip_scan();
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline bool basic_file<P>::skip_scan() {
+  // scan for the matching closing tag without producing events, only
+  // keeping track of the nesting depth. In push mode, the scan stops if
+  // the input ran out and is continued by next()
+  size_t& depth = _skip_depth;
+  bool& slash = _skip_slash;
+  pfxml::state& st = _skip_st;
+  void* i;
+
+  while (true) {
+    for (; _c - _buf[_which] < _last_bytes; ++_c) {
+      char c = *_c;
+      switch (st) {
+        case IN_TAG_TENTATIVE:
+          if (c == '/') {
+            st = IN_TAG_CLOSE;
+            continue;
+          } else if (c == '!') {
+            st = IN_COMMENT_TENTATIVE;
+            continue;
+          } else if (c == '?') {
+            st = IN_TAG_NAME_META;
+            continue;
+          } else if (_resync && depth <= _sync_max &&
+                     (std::isalnum(c) || c == '-' || c == '_' || c == '.')) {
+            // continue parsing at this start tag
+            _ret.name = _c;
+            _ret.text = empty_str;
+            _ret.attrs.clear();
+            _s.s = IN_TAG_NAME;
+            resynced(depth, _lt);
+            return true;
+          }
+          st = IN_TAG;
+          slash = false;
+          // fall through
+
+        case IN_TAG:
+          if (c == '>') {
+            if (!slash) depth++;
+            st = NONE;
+          } else if (c == '"') {
+            st = IN_ATTRVAL_DQ;
+          } else if (c == '\'') {
+            st = IN_ATTRVAL_SQ;
+          }
+          slash = c == '/';
+          continue;
+
+        case IN_ATTRVAL_DQ:
+          i = memchr(_c, '"', _last_bytes - (_c - _buf[_which]));
+          if (!i) {
+            _c = _buf[_which] + _last_bytes;
+            continue;
+          }
+          _c = (char*)i;
+          st = IN_TAG;
+          continue;
+
+        case IN_ATTRVAL_SQ:
+          i = memchr(_c, '\'', _last_bytes - (_c - _buf[_which]));
+          if (!i) {
+            _c = _buf[_which] + _last_bytes;
+            continue;
+          }
+          _c = (char*)i;
+          st = IN_TAG;
+          continue;
+
+        case IN_TAG_CLOSE:
+          i = memchr(_c, '>', _last_bytes - (_c - _buf[_which]));
+          if (!i) {
+            _c = _buf[_which] + _last_bytes;
+            continue;
+          }
+          _c = (char*)i;
+          st = NONE;
+          if (_resync) {
+            if (depth) depth--;
+            continue;
+          }
+          if (--depth == 0) {
+            if (P::offsets) _eend = pos(_c) + 1;
+            _c++;
+            _s.tag_stack.pop();
+            _s.hanging = 0;
+            _s.s = NONE;
+            _partial = false;
+            return true;
+          }
+          continue;
+
+        case IN_COMMENT_TENTATIVE:
+          st = c == '-' ? IN_COMMENT_TENTATIVE2 : IN_TAG_NAME_META;
+          if (c == '>') st = NONE;
+          continue;
+
+        case IN_COMMENT_TENTATIVE2:
+          st = c == '-' ? IN_COMMENT : IN_TAG_NAME_META;
+          if (c == '>') st = NONE;
+          continue;
+
+        case IN_COMMENT_CL_TENTATIVE:
+          st = c == '-' ? IN_COMMENT_CL_TENTATIVE2 : IN_COMMENT;
+          continue;
+
+        case IN_COMMENT_CL_TENTATIVE2:
+          if (c == '>') {
+            st = NONE;
+            continue;
+          } else if (c == '-') {
+            continue;
+          }
+          st = IN_COMMENT;
+          // fall through
+
+        case IN_COMMENT:
+          i = memchr(_c, '-', _last_bytes - (_c - _buf[_which]));
+          if (!i) {
+            _c = _buf[_which] + _last_bytes;
+            continue;
+          }
+          _c = (char*)i;
+          st = IN_COMMENT_CL_TENTATIVE;
+          continue;
+
+        case IN_TAG_NAME_META:
+          i = memchr(_c, '>', _last_bytes - (_c - _buf[_which]));
+          if (!i) {
+            _c = _buf[_which] + _last_bytes;
+            continue;
+          }
+          _c = (char*)i;
+          st = NONE;
+          continue;
+
+        default:
+          i = memchr(_c, '<', _last_bytes - (_c - _buf[_which]));
+          if (!i) {
+            _c = _buf[_which] + _last_bytes;
+            continue;
+          }
+          _c = (char*)i;
+          st = IN_TAG_TENTATIVE;
+          _lt = pos(_c);
+          continue;
+      }
+    }
+
+    if (_push) {
+      _c = _buf[_which] + _last_bytes;
+      if (append()) continue;
+      if (!_feed_n && !_eof) {
+        _partial = true;
+        return false;
+      }
+    }
+
+    unpin(!_which);
+    grow(!_which);
+    if (!refill(0)) break;
+  }
+
+  if (!_lenient) {
+    throw parse_exc("XML tree not complete", _path, _c, _buf[_which],
+                    _prevs.off);
+  }
+
+  // the open elements are closed at the end of the input
+  _c = _buf[_which] + _last_bytes;
+  if (!_resync) record("XML tree not complete");
+  resynced(0, pos(_c));
+  _s.s = NONE;
+  _partial = false;
+  return true;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::set_lenient(bool lenient, size_t level,
+                                       const error_handler& handler) {
+  _lenient = lenient;
+  _sync_level = level;
+  _on_error = handler;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline const std::vector<parse_error>& basic_file<P>::errors() const {
+  return _errors;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline size_t basic_file<P>::error_count() const {
+  return _err_count;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline bool basic_file<P>::error(const std::string& msg, pfxml::state st) {
+  if (!_lenient) throw parse_exc(msg, _path, _c, _buf[_which], _prevs.off);
+
+  record(msg);
+
+  // skip the broken event with the scanner of skip(), which continues with
+  // the state st and tracks the number of open elements
+  _resync = true;
+  _skip_depth = _s.tag_stack.size() - 1;
+  _skip_st = st;
+  _skip_slash = false;
+  _sync_max = _skip_depth;
+  if (_sync_level && _sync_level - 1 < _sync_max) _sync_max = _sync_level - 1;
+  return skip_scan();
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::close_wrong() {
+  std::string msg = std::string("Closing wrong tag '<") + _tmp +
+                    ">', expected close of '<" + _s.tag_stack.top() + ">'.";
+  if (!_lenient) throw parse_exc(msg, _path, _c, _buf[_which], _prevs.off);
+
+  record(msg);
+
+  // close the matching ancestor and everything it contains, a closing tag
+  // without a matching ancestor is ignored
+  std::vector<std::string> popped;
+  while (_s.tag_stack.size() > 1 && _s.tag_stack.top() != _tmp) {
+    popped.push_back(_s.tag_stack.top());
+    _s.tag_stack.pop();
+  }
+
+  if (_s.tag_stack.size() > 1) {
+    _s.tag_stack.pop();
+  } else {
+    for (auto it = popped.rbegin(); it != popped.rend(); ++it) {
+      _s.tag_stack.push(*it);
+    }
+  }
+
+  _err.resumed = pos(_c) + 1;
+  report();
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::record(const std::string& msg) {
+  _err.msg = msg;
+  _err.context = context();
+  _err.offset = pos(_c);
+  _err.resumed = _err.offset;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::resynced(size_t depth, int64_t off) {
+  while (_s.tag_stack.size() > depth + 1) _s.tag_stack.pop();
+  _s.hanging = 0;
+  _resync = false;
+  _skip_depth = 0;
+
+  _err.resumed = off;
+  report();
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::report() {
+  _err_count++;
+  if (_errors.size() < MAX_ERRORS) _errors.push_back(_err);
+  if (_on_error) _on_error(_err);
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline std::string basic_file<P>::context() const {
+  int64_t off = _c - _buf[_which];
+  int64_t beg = std::max<int64_t>(0, off - 32);
+  int64_t end = std::min<int64_t>(_last_bytes, off + 32);
+  if (end < beg) end = beg;
+
+  // the parser may already have terminated strings in the buffer
+  std::string ret(_buf[_which] + beg, end - beg);
+  for (auto& c : ret) {
+    if (c == 0 || c == '\n' || c == '\r' || c == '\t') c = ' ';
+  }
+  return ret;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::push_tag() {
+  if (P::validate) {
+    _s.tag_stack.push(_ret.name);
+  } else {
+    _s.tag_stack.push(std::string());
+  }
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline int64_t basic_file<P>::read_bytes(char* buf, size_t n) {
+  if (_push) {
+    n = std::min(n, _feed_n);
+    if (!n) return 0;
+    memcpy(buf, _feed, n);
+    _feed += n;
+    _feed_n -= n;
+    return n;
+  }
+
+  int64_t r = 0;
+  if (_gzip) {
+#ifndef PFXML_NO_ZLIB
+    r = gzread(_gzfile, buf, n);
+#endif
+  } else if (_bzip) {
+#ifndef PFXML_NO_BZLIB
+    int err;
+    r = BZ2_bzRead(&err, _bzfile, buf, n);
+#endif
+  } else {
+    r = read(_file, buf, n);
+  }
+  if (r > 0) _bytes_read += r;
+  return r;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline int64_t basic_file<P>::fill(char* buf, size_t n) {
+  // fed input is already transcoded
+  if (_push) return read_bytes(buf, n);
+
+  if (_detect) {
+    // read the start of the input to determine its encoding
+    _detect = false;
+    _raw.resize(1024);
+    while (_raw_end < _raw.size()) {
+      int64_t r = read_bytes(&_raw[_raw_end], _raw.size() - _raw_end);
+      if (r <= 0) break;
+      _raw_end += r;
+    }
+    _raw_beg = detect(_raw.data(), _raw_end);
+    _tot_read_bef += _raw_beg;
+    _u8_off += _raw_beg;
+    if (_enc != UTF8) _raw.resize(1024 * 1024);
+  }
+
+  if (_enc == UTF8 && _raw_beg == _raw_end) {
+    int64_t r = read_bytes(buf, n);
+    if (P::utf8 && r > 0) check_utf8(buf, r);
+    if (P::utf8 && r <= 0 && _u8_need) {
+      throw parse_exc("Invalid UTF-8", _path, 0, 0, _u8_off);
+    }
+    return r;
+  }
+
+  while (true) {
+    if (_raw_end - _raw_beg < 4 && !_raw_eof) {
+      // keep incomplete chars
+      memmove(&_raw[0], &_raw[_raw_beg], _raw_end - _raw_beg);
+      _raw_end -= _raw_beg;
+      _raw_beg = 0;
+      int64_t r = read_bytes(&_raw[_raw_end], _raw.size() - _raw_end);
+      if (r <= 0) {
+        _raw_eof = true;
+      } else {
+        _raw_end += r;
+      }
+    }
+
+    size_t used;
+    size_t w = transcode(&_raw[_raw_beg], _raw_end - _raw_beg, buf, n, &used,
+                         _raw_eof);
+    _raw_beg += used;
+    if (w || _raw_eof || _raw_end - _raw_beg >= 4) return w;
+  }
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline size_t basic_file<P>::detect(const char* p, size_t n) {
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(p);
+  _enc = UTF8;
+
+  // byte order marks
+  if (n >= 3 && s[0] == 0xEF && s[1] == 0xBB && s[2] == 0xBF) return 3;
+  if (n >= 2 && s[0] == 0xFF && s[1] == 0xFE) {
+    _enc = UTF16LE;
+    return 2;
+  }
+  if (n >= 2 && s[0] == 0xFE && s[1] == 0xFF) {
+    _enc = UTF16BE;
+    return 2;
+  }
+
+  // UTF-16 without byte order mark
+  if (n >= 2 && s[0] == '<' && s[1] == 0) {
+    _enc = UTF16LE;
+    return 0;
+  }
+  if (n >= 2 && s[0] == 0 && s[1] == '<') {
+    _enc = UTF16BE;
+    return 0;
+  }
+
+  // encoding declaration
+  if (n < 5 || memcmp(p, "<?xml", 5) != 0) return 0;
+  const char* end = static_cast<const char*>(memchr(p, '>', n));
+  if (!end) return 0;
+  std::string decl(p, end);
+
+  size_t beg = decl.find("encoding");
+  if (beg == std::string::npos) return 0;
+  beg = decl.find_first_of("\"'", beg);
+  if (beg == std::string::npos) return 0;
+  size_t fin = decl.find(decl[beg], beg + 1);
+  if (fin == std::string::npos) return 0;
+
+  std::string name = decl.substr(beg + 1, fin - beg - 1);
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+  if (name == "iso-8859-1" || name == "iso8859-1" || name == "iso_8859-1" ||
+      name == "latin1" || name == "latin-1" || name == "l1") {
+    _enc = LATIN1;
+  } else if (name == "windows-1252" || name == "cp1252") {
+    _enc = CP1252;
+  } else if (name != "utf-8" && name != "utf8" && name != "us-ascii" &&
+             name != "ascii" && name != "utf-16") {
+    // UTF-16 without zero bytes in the declaration is taken as UTF-8
+    throw parse_exc("Unsupported encoding '" + name + "'", _path, 0, 0, 0);
+  }
+
+  return 0;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline size_t basic_file<P>::transcode(const char* in, size_t n, char* out,
+                                       size_t out_n, size_t* used,
+                                       bool last) {
+  // transcode the complete chars in [in, in + n) which fit into out_n bytes
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(in);
+  const unsigned char* e = s + n;
+  char* o = out;
+  char* oe = out + out_n;
+
+  if (_enc == UTF8) {
+    size_t m = std::min(n, out_n);
+    memcpy(out, in, m);
+    if (P::utf8) check_utf8(out, m);
+    *used = m;
+    return m;
+  } else if (_enc == LATIN1 || _enc == CP1252) {
+    while (s < e && oe - o >= 3) {
+#ifdef __SSE2__
+      // copy runs of ASCII chars
+      while (e - s >= 16 && oe - o >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+        if (_mm_movemask_epi8(v)) break;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o), v);
+        s += 16;
+        o += 16;
+      }
+      if (s == e || oe - o < 3) break;
+#endif
+      unsigned char c = *s++;
+      if (c < 0x80) {
+        *o++ = c;
+      } else if (_enc == CP1252 && c < 0xA0) {
+        o += utf8(CP1252_HIGH[c - 0x80], o);
+      } else {
+        o += utf8(c, o);
+      }
+    }
+  } else {
+    bool be = _enc == UTF16BE;
+    while (e - s >= 2 && oe - o >= 4) {
+#ifdef __SSE2__
+      // 8 code units below 0x80 at once
+      const __m128i hi = _mm_set1_epi16(static_cast<int16_t>(0xFF80));
+      while (e - s >= 16 && oe - o >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+        if (be) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        __m128i z = _mm_cmpeq_epi16(_mm_and_si128(v, hi), _mm_setzero_si128());
+        if (_mm_movemask_epi8(z) != 0xFFFF) break;
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(o), _mm_packus_epi16(v, v));
+        s += 16;
+        o += 8;
+      }
+      if (e - s < 2 || oe - o < 4) break;
+#endif
+      size_t u = be ? (s[0] << 8) | s[1] : s[0] | (s[1] << 8);
+      size_t len = 2;
+      if (u >= 0xD800 && u <= 0xDFFF) {
+        size_t l = 0;
+        if (e - s >= 4) l = be ? (s[2] << 8) | s[3] : s[2] | (s[3] << 8);
+        if (u <= 0xDBFF && l >= 0xDC00 && l <= 0xDFFF) {
+          u = 0x10000 + ((u - 0xD800) << 10) + (l - 0xDC00);
+          len = 4;
+        } else if (u <= 0xDBFF && e - s < 4 && !last) {
+          // the low surrogate was not read yet
+          break;
+        } else {
+          u = 0xFFFD;
+        }
+      }
+      s += len;
+      o += utf8(u, o);
+    }
+
+    // a trailing odd byte
+    if (last && e - s == 1 && oe - o >= 3) {
+      s++;
+      o += utf8(0xFFFD, o);
+    }
+  }
+
+  *used = s - reinterpret_cast<const unsigned char*>(in);
+  return o - out;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::check_utf8(const char* p, size_t n) {
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(p);
+  const unsigned char* e = s + n;
+  bool bad = false;
+#ifdef __SSSE3__
+  bool blocks = true;
+#endif
+
+  while (s < e) {
+#if defined(__SSSE3__)
+    if (!_u8_need && blocks && e - s >= 16) {
+      s = check_utf8_blocks(s, e, &blocks);
+      if (s == e) break;
+    }
+#elif defined(__SSE2__)
+    // skip blocks of ASCII chars
+    if (!_u8_need) {
+      while (e - s >= 16 &&
+             !_mm_movemask_epi8(
+                 _mm_loadu_si128(reinterpret_cast<const __m128i*>(s)))) {
+        s += 16;
+      }
+      if (s == e) break;
+    }
+#endif
+    unsigned char c = *s++;
+    if (_u8_need) {
+      if (c < _u8_lo || c > _u8_hi) {
+        bad = true;
+        break;
+      }
+      _u8_lo = 0x80;
+      _u8_hi = 0xBF;
+      _u8_need--;
+      continue;
+    }
+
+    _u8_lo = 0x80;
+    _u8_hi = 0xBF;
+    if (c < 0x80) {
+      continue;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+      _u8_need = 1;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      _u8_need = 2;
+      if (c == 0xE0) _u8_lo = 0xA0;
+      if (c == 0xED) _u8_hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      _u8_need = 3;
+      if (c == 0xF0) _u8_lo = 0x90;
+      if (c == 0xF4) _u8_hi = 0x8F;
+    } else {
+      bad = true;
+      break;
+    }
+  }
+
+  if (bad) {
+    int64_t off =
+        _u8_off + (s - 1 - reinterpret_cast<const unsigned char*>(p));
+    throw parse_exc("Invalid UTF-8", _path, 0, 0, off);
+  }
+  _u8_off += n;
+}
+
+#ifdef __SSSE3__
+// _____________________________________________________________________________
+template <typename P>
+inline const unsigned char* basic_file<P>::check_utf8_blocks(
+    const unsigned char* s, const unsigned char* e, bool* ok) {
+  // validates blocks of 16 bytes as in Keiser and Lemire, "Validating UTF-8
+  // In Less Than One Instruction Per Byte". Three tables map the high and
+  // low nibble of the previous byte and the high nibble of a byte to the
+  // errors they allow, an error is present if all three agree. Returns
+  // where the scalar check continues, which is the start of the last char
+  // as it may be incomplete, or the start of the char containing the first
+  // invalid block with *ok set to false
+  static const unsigned char T[48] = {
+      // high nibble of the previous byte
+      0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x80, 0x80, 0x80, 0x80,
+      0x21, 0x01, 0x15, 0x49,
+      // low nibble of the previous byte
+      0xE7, 0xA3, 0x83, 0x83, 0x8B, 0xCB, 0xCB, 0xCB, 0xCB, 0xCB, 0xCB, 0xCB,
+      0xCB, 0xDB, 0xCB, 0xCB,
+      // high nibble of the byte
+      0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0xE6, 0xAE, 0xBA, 0xBA,
+      0x01, 0x01, 0x01, 0x01};
+  const __m128i hi1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(T));
+  const __m128i lo1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(T + 16));
+  const __m128i hi2 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(T + 32));
+  const __m128i nib = _mm_set1_epi8(0x0F);
+  const __m128i zero = _mm_setzero_si128();
+
+  const unsigned char* b = s;
+  __m128i prev = zero;
+  bool prev_ascii = true;
+
+  for (; e - s >= 16; s += 16) {
+    __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    bool ascii = !_mm_movemask_epi8(in);
+    if (!ascii || !prev_ascii) {
+      __m128i p1 = _mm_alignr_epi8(in, prev, 15);
+      __m128i sc = _mm_and_si128(
+          _mm_and_si128(
+              _mm_shuffle_epi8(hi1, _mm_and_si128(_mm_srli_epi16(p1, 4), nib)),
+              _mm_shuffle_epi8(lo1, _mm_and_si128(p1, nib))),
+          _mm_shuffle_epi8(hi2, _mm_and_si128(_mm_srli_epi16(in, 4), nib)));
+
+      // the third and fourth byte of a char must be continuation bytes
+      __m128i must = _mm_or_si128(
+          _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), _mm_set1_epi8(0x60)),
+          _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), _mm_set1_epi8(0x70)));
+      __m128i err =
+          _mm_xor_si128(_mm_and_si128(must, _mm_set1_epi8(-128)), sc);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, zero)) != 0xFFFF) {
+        *ok = false;
+        break;
+      }
+    }
+    prev = in;
+    prev_ascii = ascii;
+  }
+
+  // back to the lead byte of the char the blocks end in
+  const unsigned char* r = s;
+  while (r > b && s - r < 3 && (r[-1] & 0xC0) == 0x80) r--;
+  if (r > b && r[-1] >= 0xC0) r--;
+  return r;
+}
+#endif
+
+// _____________________________________________________________________________
+template <typename P>
+inline bool basic_file<P>::refill(size_t off) {
+  // the carried over part of the current event fills the whole buffer
+  if (off >= _chunks[!_which]->cap) {
+    throw parse_exc("Event exceeds buffer size", _path, 0, 0, _prevs.off);
+  }
+
+  int64_t readb = fill(_buf[!_which] + off, _chunks[!_which]->cap - off);
+  if (readb <= 0) return false;
+  _tot_read_bef += _last_new_data;
+  _which = !_which;
+  _refills++;
+  _last_new_data = readb;
+  _last_bytes = _last_new_data + off;
+  _c = _buf[_which] + off;
+  return true;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::rebase(const char* beg, char* dst) {
+  // move the pointers into the open start tag at beg to its copy at dst
+  pfxml::state st = _s.s;
+  _ret.name = dst;
+  for (auto& kv : _ret.attrs) {
+    kv.first = dst + (kv.first - beg);
+    kv.second = dst + (kv.second - beg);
+  }
+  if (P::attrs && !P::lazy &&
+      (st == IN_ATTRKEY || st == AFTER_ATTRKEY || st == AW_IN_ATTRVAL ||
+       st == IN_ATTRVAL_SQ || st == IN_ATTRVAL_DQ)) {
+    _tmp = dst + (_tmp - beg);
+    if (st == IN_ATTRVAL_SQ || st == IN_ATTRVAL_DQ) {
+      _tmp2 = dst + (_tmp2 - beg);
+    }
+  }
+  if (P::lazy && _ret.lazy) {
+    if (st == AW_CLOSING || st == WS_SKIP) {
+      _ret.lazy_end = dst + (_ret.lazy_end - beg);
+    }
+    _ret.lazy = dst + (_ret.lazy - beg);
+  }
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline bool basic_file<P>::in_start_tag(pfxml::state s) {
+  return s == IN_TAG_NAME || s == IN_TAG || s == IN_ATTRKEY ||
+         s == AFTER_ATTRKEY || s == AW_IN_ATTRVAL || s == IN_ATTRVAL_SQ ||
+         s == IN_ATTRVAL_DQ || s == AW_CLOSING || s == WS_SKIP;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline bool basic_file<P>::append() {
+  // fill up the current buffer with fed input before switching buffers, so
+  // that small feeds do not cycle through the buffers
+  size_t n = std::min<size_t>(_feed_n, _chunks[_which]->cap - _last_bytes);
+  if (!n) return false;
+  memcpy(_buf[_which] + _last_bytes, _feed, n);
+  _feed += n;
+  _feed_n -= n;
+  _last_bytes += n;
+  _last_new_data += n;
+  return true;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::feed(const char* data, size_t n) {
+  if (_feed_n) {
+    throw parse_exc("Previous input was not consumed yet", _path, 0, 0, 0);
+  }
+  _bytes_read += n;
+
+  if (_detect) {
+    // collect the start of the input up to the end of the XML declaration
+    // to determine the encoding
+    const char* p = data;
+    size_t m = n;
+    if (_raw.size() || (!_eof && n < 1024 && !memchr(data, '>', n))) {
+      _raw.insert(_raw.end(), data, data + n);
+      p = _raw.data();
+      m = _raw.size();
+      if (!_eof && m < 1024 && !memchr(p, '>', m)) return;
+    }
+    _detect = false;
+    size_t bom = detect(p, m);
+    _tot_read_bef += bom;
+    _u8_off += bom;
+
+    if (p == data) {
+      data += bom;
+      n -= bom;
+    } else {
+      _raw.erase(_raw.begin(), _raw.begin() + bom);
+      data = 0;
+      n = 0;
+      if (_enc == UTF8) {
+        _dec.swap(_raw);
+        _raw.clear();
+        data = _dec.data();
+        n = _dec.size();
+      }
+    }
+  }
+
+  if (_enc != UTF8) {
+    // incomplete chars at the end are kept for the next feed
+    size_t used;
+    _raw.insert(_raw.end(), data, data + n);
+    _dec.resize(_raw.size() * 3 + 8);
+    n = transcode(_raw.data(), _raw.size(), _dec.data(), _dec.size(), &used,
+                  false);
+    _raw.erase(_raw.begin(), _raw.begin() + used);
+    data = _dec.data();
+  } else if (P::utf8) {
+    check_utf8(data, n);
+  }
+
+  _feed = data;
+  _feed_n = n;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::finish() {
+  _eof = true;
+  if (_detect && _raw.size()) feed(0, 0);
+  if (_enc != UTF8 && _raw.size() && !_feed_n) {
+    size_t used;
+    _dec.resize(_raw.size() * 3 + 8);
+    _feed_n = transcode(_raw.data(), _raw.size(), _dec.data(), _dec.size(),
+                        &used, true);
+    _feed = _dec.data();
+    _raw.clear();
+  }
+  if (P::utf8 && _u8_need) {
+    throw parse_exc("Invalid UTF-8", _path, 0, 0, _u8_off);
+  }
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline bool basic_file<P>::needs_input() const {
+  return _partial;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline encoding basic_file<P>::input_encoding() const {
+  return _enc;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::unpin(size_t i) {
+  if (!_chunks[i]->refs.load(std::memory_order_acquire)) return;
+
+  // recycle chunks which were released in the meantime
+  for (size_t j = 0; j < _pinned.size(); j++) {
+    if (_pinned[j]->refs.load(std::memory_order_acquire)) continue;
+    if (_free.size() < 2) {
+      _free.push_back(_pinned[j]);
+    } else {
+      delete _pinned[j];
+    }
+    _pinned[j] = _pinned.back();
+    _pinned.pop_back();
+    j--;
+  }
+
+  _pinned.push_back(_chunks[i]);
+  if (_free.size()) {
+    _chunks[i] = _free.back();
+    _free.pop_back();
+  } else {
+    _chunks[i] = new chunk(_pinned.back()->cap);
+  }
+  _buf[i] = _chunks[i]->buf;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline void basic_file<P>::grow(size_t i) {
+  // the buffers grow with each refill, small inputs only use small buffers
+  size_t cap = std::min(_max_buf, _chunks[!i]->cap * 4);
+  if (_chunks[i]->cap >= cap) return;
+  delete _chunks[i];
+  _chunks[i] = new chunk(cap);
+  _buf[i] = _chunks[i]->buf;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline chunk_pin basic_file<P>::pin() {
+  return chunk_pin(_chunks[0], _chunks[1]);
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline retained basic_file<P>::retain() {
+  retained r;
+  r._tag = _ret;
+  r._level = level();
+  r._pin = pin();
+  return r;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline size_t basic_file<P>::refills() const { return _refills; }
+
+// _____________________________________________________________________________
+template <typename P>
+inline const node* basic_file<P>::read_subtree(arena& a) {
+  if (_sub.empty()) {
+    node* n = a.copy(_ret);
+    if (!*_ret.name) return n;
+    _sub_lvl = level();
+    _sub.push_back({n, 0});
+  }
+
+  while (next()) {
+    size_t lvl = level();
+    if (lvl <= _sub_lvl) {
+      // the first event after the subtree
+      _replay = true;
+      break;
+    }
+
+    _sub.resize(lvl - _sub_lvl);
+    node* n = a.copy(_ret);
+    auto& par = _sub.back();
+    if (par.second) {
+      par.second->next = n;
+    } else {
+      par.first->child = n;
+    }
+    par.second = n;
+    if (*n->name) _sub.push_back({n, 0});
+  }
+
+  if (!_replay && needs_input()) return 0;
+
+  const node* ret = _sub.front().first;
+  _sub.clear();
+  return ret;
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline char* basic_file<P>::tag_end(char* p, char* end) {
+  // the next quote, '/' or '>'
+#ifdef __SSE2__
+  const __m128i dq = _mm_set1_epi8('"');
+  const __m128i sq = _mm_set1_epi8('\'');
+  const __m128i sl = _mm_set1_epi8('/');
+  const __m128i gt = _mm_set1_epi8('>');
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i q = _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, sq));
+    __m128i e = _mm_or_si128(_mm_cmpeq_epi8(v, sl), _mm_cmpeq_epi8(v, gt));
+    int m = _mm_movemask_epi8(_mm_or_si128(q, e));
+    if (m) return p + __builtin_ctz(m);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != '"' && *p != '\'' && *p != '/' && *p != '>') p++;
+  return p;
+}
+
+// _____________________________________________________________________________
+inline void tag::tokenize() const {
+  // the NUL bytes written here are accepted as separators, as copies of this
+  // tag may tokenize the same attributes again
+  char* p = lazy;
+  lazy = 0;
+  while (p < lazy_end) {
+    while (p < lazy_end && (!*p || std::isspace(*p))) p++;
+    char* k = p;
+    while (p < lazy_end && *p && *p != '=' && !std::isspace(*p)) p++;
+    while (p < lazy_end && *p != '"' && *p != '\'') *p++ = 0;
+    if (p == lazy_end) break;
+    char q = *p++;
+    char* v = p;
+    while (p < lazy_end && *p && *p != q) p++;
+    if (p == lazy_end) break;
+    *p++ = 0;
+    attrs.push_back({k, v});
+  }
+}
+
+// _____________________________________________________________________________
+inline arena::arena(size_t block_size)
+    : _block_s(block_size), _cur(0), _used(0) {}
+
+// _____________________________________________________________________________
+inline arena::~arena() {
+  for (const auto& b : _blocks) delete[] b.first;
+}
+
+// _____________________________________________________________________________
+inline void* arena::alloc(size_t n, size_t align) {
+  while (true) {
+    if (_cur < _blocks.size()) {
+      size_t off = (_used + align - 1) & ~(align - 1);
+      if (off + n <= _blocks[_cur].second) {
+        _used = off + n;
+        return _blocks[_cur].first + off;
+      }
+      if (++_cur < _blocks.size()) {
+        _used = 0;
+        continue;
+      }
+    }
+    // blocks are aligned for any type
+    size_t size = std::max(n, _block_s);
+    _blocks.push_back({new char[size], size});
+    _cur = _blocks.size() - 1;
+    _used = 0;
+  }
+}
+
+// _____________________________________________________________________________
+inline node* arena::copy(const tag& t) {
+  const attr_map& a = t.all_attrs();
+  size_t name_n = strlen(t.name) + 1;
+  size_t text_n = strlen(t.text) + 1;
+  size_t len = sizeof(node) + a.size() * sizeof(attr_map::value_type) +
+               name_n + text_n;
+  for (const auto& kv : a) {
+    len += strlen(kv.first) + strlen(kv.second) + 2;
+  }
+
+  // the node, its attributes and its strings are stored in one piece
+  char* p = static_cast<char*>(alloc(len, alignof(node)));
+  node* n = reinterpret_cast<node*>(p);
+  attr_map::value_type* attrs =
+      reinterpret_cast<attr_map::value_type*>(p + sizeof(node));
+  char* s = p + sizeof(node) + a.size() * sizeof(attr_map::value_type);
+
+  memcpy(s, t.name, name_n);
+  n->name = s;
+  s += name_n;
+  memcpy(s, t.text, text_n);
+  n->text = s;
+  s += text_n;
+
+  for (size_t i = 0; i < a.size(); i++) {
+    size_t k = strlen(a[i].first) + 1;
+    size_t v = strlen(a[i].second) + 1;
+    memcpy(s, a[i].first, k);
+    memcpy(s + k, a[i].second, v);
+    new (&attrs[i]) attr_map::value_type(s, s + k);
+    s += k + v;
+  }
+
+  n->attrs = attrs;
+  n->nattrs = a.size();
+  n->child = 0;
+  n->next = 0;
+  return n;
+}
+
+// _____________________________________________________________________________
+inline void arena::clear() {
+  _cur = 0;
+  _used = 0;
+}
+
+// _____________________________________________________________________________
+inline chunk_pin::chunk_pin(chunk* a, chunk* b) : _c{a, b} {
+  _c[0]->refs.fetch_add(1, std::memory_order_relaxed);
+  _c[1]->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+// _____________________________________________________________________________
+inline chunk_pin::chunk_pin(chunk_pin&& p) : _c{p._c[0], p._c[1]} {
+  p._c[0] = 0;
+  p._c[1] = 0;
+}
+
+// _____________________________________________________________________________
+inline chunk_pin& chunk_pin::operator=(chunk_pin&& p) {
+  if (this == &p) return *this;
+  release();
+  _c[0] = p._c[0];
+  _c[1] = p._c[1];
+  p._c[0] = 0;
+  p._c[1] = 0;
+  return *this;
+}
+
+// _____________________________________________________________________________
+inline void chunk_pin::release() {
+  for (size_t i = 0; i < 2; i++) {
+    if (_c[i]) _c[i]->refs.fetch_sub(1, std::memory_order_release);
+    _c[i] = 0;
+  }
+}
+
+// _____________________________________________________________________________
+template <typename P>
+inline std::string basic_file<P>::decode(const std::string& str) {
   return decode(str.c_str());
 }
 
 // _____________________________________________________________________________
-inline std::string file::decode(const char* str) {
+template <typename P>
+inline std::string basic_file<P>::decode(const char* str) {
   const char* c = strchr(str, '&');
   if (!c) return str;
 
@@ -1006,7 +2739,8 @@ inline std::string file::decode(const char* str) {
 }
 
 // _____________________________________________________________________________
-inline size_t file::utf8(size_t cp, char* out) {
+template <typename P>
+inline size_t basic_file<P>::utf8(size_t cp, char* out) {
   if (cp <= 0x7F) {
     out[0] = cp & 0x7F;
     return 1;
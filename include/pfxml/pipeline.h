@@ -0,0 +1,233 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#ifndef PFXML_PIPELINE_H_
+#define PFXML_PIPELINE_H_
+
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "pfxml/fanout.h"
+#include "pfxml/pfxml.h"
+
+namespace pfxml {
+
+// Pipelined parsing. The parser thread groups events into batches which
+// point directly into the parser buffers, and hands each batch to one of
+// several worker threads. The buffers referenced by a batch are pinned and
+// only recycled once the batch was processed, so no string is ever copied.
+// Each worker has its own consumer, events are thus processed in parallel,
+// but a single consumer only sees a subset of the events (whole batches).
+
+class pipeline {
+ public:
+  // ring_cap is the number of batches a worker may lag behind, batch_size
+  // the maximum number of events per batch
+  explicit pipeline(size_t ring_cap = 16, size_t batch_size = 4096);
+  ~pipeline();
+
+  // register a worker with its own consumer, which is not owned by the
+  // pipeline
+  void add(consumer* c);
+
+  // parse xml and distribute the events to the workers. Exceptions thrown by
+  // consumers stop the parsing and are rethrown after all threads have been
+  // stopped, no consumer is finished then
+  template <typename F>
+  void run(F& xml);
+
+ private:
+  class batch {
+   public:
+    template <typename F>
+    void add(F& xml);
+    size_t size() const { return _events.size(); }
+    void replay(consumer* c) const;
+
+   private:
+    struct ev {
+      const char* name;
+      const char* text;
+      size_t level;
+      size_t attrs;
+      size_t nattrs;
+      char* lazy;
+      char* lazy_end;
+    };
+
+    std::vector<ev> _events;
+    attr_map _attrs;
+    std::vector<chunk_pin> _pins;
+    size_t _refills = -1;
+  };
+
+  typedef std::shared_ptr<batch> batch_ptr;
+
+  struct worker {
+    consumer* c;
+    spsc_ring<batch_ptr>* ring;
+    std::thread thread;
+    std::exception_ptr exc;
+  };
+
+  size_t _ring_cap;
+  size_t _batch_size;
+  std::vector<worker*> _workers;
+  run_barrier _barrier;
+
+  void publish(batch_ptr* b, size_t* next);
+  static void work(worker* w, run_barrier* barrier);
+};
+
+// _____________________________________________________________________________
+template <typename F>
+inline void pipeline::batch::add(F& xml) {
+  // pin the buffers once per refill, not once per event
+  if (xml.refills() != _refills) {
+    _pins.push_back(xml.pin());
+    _refills = xml.refills();
+  }
+
+  const tag& t = xml.get();
+  ev e;
+  e.name = t.name;
+  e.text = t.text;
+  e.level = xml.level();
+  e.attrs = _attrs.size();
+  e.nattrs = t.attrs.size();
+  _attrs.insert(_attrs.end(), t.attrs.begin(), t.attrs.end());
+
+  // untokenized attributes are tokenized by the worker
+  e.lazy = t.lazy;
+  e.lazy_end = t.lazy_end;
+  _events.push_back(e);
+}
+
+// _____________________________________________________________________________
+inline void pipeline::batch::replay(consumer* c) const {
+  tag t;
+  for (const auto& e : _events) {
+    t.name = e.name;
+    t.text = e.text;
+    t.attrs.assign(_attrs.begin() + e.attrs,
+                   _attrs.begin() + e.attrs + e.nattrs);
+    t.lazy = e.lazy;
+    t.lazy_end = e.lazy_end;
+    c->event(t, e.level);
+  }
+}
+
+// _____________________________________________________________________________
+inline pipeline::pipeline(size_t ring_cap, size_t batch_size)
+    : _ring_cap(ring_cap), _batch_size(batch_size) {}
+
+// _____________________________________________________________________________
+inline pipeline::~pipeline() {
+  for (auto w : _workers) {
+    delete w->ring;
+    delete w;
+  }
+}
+
+// _____________________________________________________________________________
+inline void pipeline::add(consumer* c) {
+  worker* w = new worker();
+  w->c = c;
+  w->ring = new spsc_ring<batch_ptr>(_ring_cap);
+  _workers.push_back(w);
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline void pipeline::run(F& xml) {
+  _barrier.reset(_workers.size());
+  for (auto w : _workers) {
+    w->exc = std::exception_ptr();
+    w->thread = std::thread(work, w, &_barrier);
+  }
+
+  std::exception_ptr exc;
+  size_t next = 0;
+
+  try {
+    batch_ptr b = std::make_shared<batch>();
+    while (xml.next()) {
+      b->add(xml);
+      if (b->size() >= _batch_size) {
+        // stop parsing once a consumer failed
+        if (_barrier.failed()) break;
+        publish(&b, &next);
+      }
+    }
+    if (b->size() && !_barrier.failed()) publish(&b, &next);
+  } catch (...) {
+    exc = std::current_exception();
+    _barrier.fail();
+  }
+
+  // a null batch tells the worker to stop
+  for (auto w : _workers) w->ring->push_wait(batch_ptr());
+  for (auto w : _workers) {
+    w->thread.join();
+    if (!exc && w->exc) exc = w->exc;
+  }
+
+  if (exc) std::rethrow_exception(exc);
+}
+
+// _____________________________________________________________________________
+inline void pipeline::publish(batch_ptr* b, size_t* next) {
+  if (_workers.empty()) {
+    b->reset(new batch());
+    return;
+  }
+
+  // hand the batch to the next worker with free capacity. If all workers
+  // stay busy, wait for the next one in turn
+  for (size_t r = 0; r < RING_SPINS; r++) {
+    for (size_t i = 0; i < _workers.size(); i++) {
+      worker* w = _workers[(*next + i) % _workers.size()];
+      if (w->ring->push(*b)) {
+        *next = (*next + i + 1) % _workers.size();
+        b->reset(new batch());
+        return;
+      }
+    }
+    std::this_thread::yield();
+  }
+  _workers[*next]->ring->push_wait(*b);
+  *next = (*next + 1) % _workers.size();
+  b->reset(new batch());
+}
+
+// _____________________________________________________________________________
+inline void pipeline::work(worker* w, run_barrier* barrier) {
+  batch_ptr b;
+  while (true) {
+    w->ring->pop_wait(&b);
+    if (!b) break;
+    if (!barrier->failed()) {
+      try {
+        b->replay(w->c);
+      } catch (...) {
+        w->exc = std::current_exception();
+        barrier->fail();
+      }
+    }
+    // releases the pinned buffers
+    b.reset();
+  }
+
+  if (!barrier->drained()) return;
+
+  try {
+    w->c->finish();
+  } catch (...) {
+    w->exc = std::current_exception();
+  }
+}
+}  // namespace pfxml
+
+#endif  // PFXML_PIPELINE_H_
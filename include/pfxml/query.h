@@ -0,0 +1,461 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#ifndef PFXML_QUERY_H_
+#define PFXML_QUERY_H_
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+
+namespace pfxml {
+
+// Streaming evaluation of a small XPath subset. Supported are absolute
+// location paths consisting of child ("/") and descendant ("//") steps, name
+// tests (including "*"), attribute predicates ("[@k]", "[@k='v']"), child
+// predicates on the last step ("[tag]", "[tag/@k='v']") and a trailing
+// attribute selection ("/@ref"). Attribute values are compared and returned
+// with their entities decoded. Examples:
+//
+//   /osm/way/nd/@ref
+//   /osm/node[tag/@k='amenity']
+//   //relation/member
+//
+// The path is compiled once into a (non-deterministic) automaton whose state
+// sets are kept on a stack parallel to the tag stack of the parser. Subtrees
+// in which no automaton state is alive anymore are skipped without producing
+// any events.
+
+class query_exc : public std::exception {
+ public:
+  query_exc(std::string msg, const std::string& path, size_t pos) {
+    std::stringstream ss;
+    ss << "'" << path << "' at position " << pos << ": " << msg;
+    _msg = ss.str();
+  }
+  ~query_exc() throw() {}
+
+  virtual const char* what() const throw() { return _msg.c_str(); }
+
+ private:
+  std::string _msg;
+};
+
+struct query_pred {
+  std::string child;  // empty if the predicate is on the element itself
+  std::string attr;   // empty if only the existence of child is tested
+  std::string val;
+  bool has_val;
+};
+
+struct query_step {
+  bool desc;
+  std::string name;
+  std::vector<query_pred> preds;
+  bool child_preds;
+};
+
+class query {
+ public:
+  query(const std::string& path);
+
+  // advance to the next match in xml, returns false if there are no more
+  // matches. xml must not be advanced by the caller while a query is running
+  template <typename F>
+  bool next(F& xml);
+
+  // prepare the query for a new run, e.g. after xml.reset()
+  void reset();
+
+  // the caller advanced xml past the last match (e.g. to copy its subtree),
+  // the current event of xml was not seen by the query and is processed
+  // first by the next call to next()
+  void resume();
+
+  // the matched element. Like the element returned by file::get(), it is
+  // only valid until next() is called
+  const tag& get() const;
+
+  // the selected attribute value of the matched element with its entities
+  // decoded, or 0 if the query does not select an attribute
+  const char* value() const;
+
+  // the level of the matched element
+  size_t level() const;
+
+  // whether the query has child predicates, i.e. matches are reported after
+  // their children were read
+  bool child_preds() const;
+
+ private:
+  // a matched element whose child predicates have not yet been satisfied,
+  // the element is copied because it has to survive its children
+  struct candidate {
+    size_t level;
+    uint64_t open;
+    std::string buf;
+    tag t;
+  };
+
+  std::string _path;
+  std::vector<query_step> _steps;
+  std::string _sel;
+
+  std::vector<uint64_t> _states;
+  std::deque<candidate> _cands;
+  const tag* _ret;
+  const char* _val;
+  std::string _dec;
+  size_t _lvl;
+  bool _skip;
+  bool _pending;
+  size_t _pending_lvl;
+  bool _resume;
+
+  void parse(const std::string& path);
+  std::string parse_name(size_t* pos, bool allow_star) const;
+  query_pred parse_pred(size_t* pos) const;
+
+  bool match_attrs(const query_step& s, const tag& t) const;
+  static bool match_pred(const query_pred& p, const tag& t);
+  static bool match_name(const std::string& name, const char* n);
+
+  bool emit(const tag& t, size_t lvl);
+  void copy(const tag& t, candidate* c) const;
+};
+
+// _____________________________________________________________________________
+inline query::query(const std::string& path) : _path(path) {
+  parse(path);
+  if (_steps.size() > 63)
+    throw query_exc("Too many location steps", _path, path.size());
+  reset();
+}
+
+// _____________________________________________________________________________
+inline void query::reset() {
+  _states.clear();
+  _states.push_back(1);
+  _cands.clear();
+  _ret = 0;
+  _val = 0;
+  _lvl = 0;
+  _skip = false;
+  _pending = false;
+  _pending_lvl = 0;
+  _resume = false;
+}
+
+// _____________________________________________________________________________
+inline void query::resume() {
+  _skip = false;
+  _pending = false;
+  _resume = true;
+}
+
+// _____________________________________________________________________________
+inline const tag& query::get() const { return *_ret; }
+
+// _____________________________________________________________________________
+inline const char* query::value() const { return _val; }
+
+// _____________________________________________________________________________
+inline size_t query::level() const { return _lvl; }
+
+// _____________________________________________________________________________
+inline bool query::child_preds() const {
+  return !_steps.empty() && _steps.back().child_preds;
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline bool query::next(F& xml) {
+  const uint64_t fin = uint64_t(1) << _steps.size();
+
+  if (_pending) {
+    // the current event also matched after a candidate was reported for it
+    _pending = false;
+    if (emit(xml.get(), _pending_lvl)) return true;
+  }
+
+  if (_skip) {
+    _skip = false;
+    xml.skip();
+  }
+
+  while (_resume || xml.next()) {
+    _resume = false;
+    const tag& cur = xml.get();
+    size_t lvl = xml.level();
+
+    while (!_cands.empty() && _cands.back().level >= lvl) _cands.pop_back();
+
+    if (!*cur.name) {
+      // text, only closes deeper levels
+      if (_states.size() > lvl) _states.resize(lvl);
+      continue;
+    }
+
+    if (_states.size() > lvl) _states.resize(lvl);
+    if (_states.size() < lvl) {
+      // should not happen, but stay safe on unexpected level jumps
+      _states.resize(lvl, 0);
+    }
+
+    uint64_t par = _states[lvl - 1];
+    uint64_t st = 0;
+    for (size_t i = 0; i < _steps.size(); i++) {
+      if (!(par & (uint64_t(1) << i))) continue;
+      const query_step& s = _steps[i];
+      if (s.desc) st |= uint64_t(1) << i;
+      if (match_name(s.name, cur.name) && match_attrs(s, cur))
+        st |= uint64_t(1) << (i + 1);
+    }
+
+    _states.push_back(st & ~fin);
+
+    // check child predicates of a pending candidate one level above
+    candidate* done = 0;
+    if (!_cands.empty() && _cands.back().level + 1 == lvl) {
+      candidate& c = _cands.back();
+      const query_step& s = _steps.back();
+      for (size_t i = 0; i < s.preds.size(); i++) {
+        if (!(c.open & (uint64_t(1) << i))) continue;
+        const query_pred& p = s.preds[i];
+        if (match_name(p.child, cur.name) &&
+            (p.attr.empty() || match_pred(p, cur))) {
+          c.open &= ~(uint64_t(1) << i);
+        }
+      }
+      if (c.open == 0) done = &c;
+    }
+
+    bool match = st & fin;
+    bool waits = false;
+
+    if (match && _steps.back().child_preds) {
+      // the element can only be reported after its children were seen
+      match = false;
+      waits = true;
+      _cands.push_back(candidate());
+      candidate& c = _cands.back();
+      c.level = lvl;
+      c.open = 0;
+      const query_step& s = _steps.back();
+      for (size_t i = 0; i < s.preds.size(); i++) {
+        if (!s.preds[i].child.empty()) c.open |= uint64_t(1) << i;
+      }
+      copy(cur, &c);
+    }
+
+    if (!(st & ~fin) && !waits) _skip = true;
+
+    if (done) {
+      done->open = uint64_t(1) << 63;  // never report a candidate twice
+      bool ret = emit(done->t, done->level);
+      if (match) {
+        _pending = true;
+        _pending_lvl = lvl;
+      }
+      if (ret) return true;
+      if (_pending) {
+        _pending = false;
+        if (emit(cur, lvl)) return true;
+      }
+    } else if (match && emit(cur, lvl)) {
+      return true;
+    }
+
+    if (_skip) {
+      _skip = false;
+      xml.skip();
+    }
+  }
+
+  _ret = 0;
+  _val = 0;
+  return false;
+}
+
+// _____________________________________________________________________________
+inline bool query::emit(const tag& t, size_t lvl) {
+  _val = 0;
+  if (!_sel.empty()) {
+    _val = t.attr(_sel.c_str());
+    if (!_val) return false;
+    if (strchr(_val, '&')) {
+      _dec = file::decode(_val);
+      _val = _dec.c_str();
+    }
+  }
+  _ret = &t;
+  _lvl = lvl;
+  return true;
+}
+
+// _____________________________________________________________________________
+inline void query::copy(const tag& t, candidate* c) const {
+  const attr_map& attrs = t.all_attrs();
+  size_t len = strlen(t.name) + 1;
+  for (const auto& kv : attrs) {
+    len += strlen(kv.first) + strlen(kv.second) + 2;
+  }
+
+  c->buf.reserve(len);
+  c->buf.append(t.name, strlen(t.name) + 1);
+  for (const auto& kv : attrs) {
+    c->buf.append(kv.first, strlen(kv.first) + 1);
+    c->buf.append(kv.second, strlen(kv.second) + 1);
+  }
+
+  const char* p = c->buf.data();
+  c->t.name = p;
+  c->t.text = "";
+  p += strlen(p) + 1;
+  for (size_t i = 0; i < attrs.size(); i++) {
+    const char* k = p;
+    p += strlen(p) + 1;
+    c->t.attrs.push_back({k, p});
+    p += strlen(p) + 1;
+  }
+}
+
+// _____________________________________________________________________________
+inline bool query::match_name(const std::string& name, const char* n) {
+  return (name.size() == 1 && name[0] == '*') || strcmp(name.c_str(), n) == 0;
+}
+
+// _____________________________________________________________________________
+inline bool query::match_pred(const query_pred& p, const tag& t) {
+  const char* v = t.attr(p.attr.c_str());
+  if (!v) return false;
+  if (!p.has_val) return true;
+  if (!strchr(v, '&')) return strcmp(v, p.val.c_str()) == 0;
+  return file::decode(v) == p.val;
+}
+
+// _____________________________________________________________________________
+inline bool query::match_attrs(const query_step& s, const tag& t) const {
+  for (const auto& p : s.preds) {
+    if (p.child.empty() && !match_pred(p, t)) return false;
+  }
+  return true;
+}
+
+// _____________________________________________________________________________
+inline void query::parse(const std::string& path) {
+  size_t pos = 0;
+
+  if (path.empty() || path[0] != '/')
+    throw query_exc("Expected absolute path", path, 0);
+
+  while (pos < path.size()) {
+    if (!_sel.empty()) throw query_exc("Expected end of path", path, pos);
+    if (path[pos] != '/') throw query_exc("Expected '/'", path, pos);
+    pos++;
+
+    bool desc = false;
+    if (pos < path.size() && path[pos] == '/') {
+      desc = true;
+      pos++;
+    }
+
+    if (pos < path.size() && path[pos] == '@') {
+      if (desc || _steps.empty())
+        throw query_exc("Attribute selection must follow a step", path, pos);
+      pos++;
+      _sel = parse_name(&pos, false);
+      continue;
+    }
+
+    query_step s;
+    s.desc = desc;
+    s.child_preds = false;
+    s.name = parse_name(&pos, true);
+
+    if (!_steps.empty() && _steps.back().child_preds)
+      throw query_exc("Child predicates are only supported on the last step",
+                      path, pos);
+
+    while (pos < path.size() && path[pos] == '[') {
+      pos++;
+      s.preds.push_back(parse_pred(&pos));
+      if (!s.preds.back().child.empty()) s.child_preds = true;
+      if (pos >= path.size() || path[pos] != ']')
+        throw query_exc("Expected ']'", path, pos);
+      pos++;
+    }
+
+    if (s.preds.size() > 63)
+      throw query_exc("Too many predicates", path, pos);
+
+    _steps.push_back(s);
+  }
+
+  if (_steps.empty()) throw query_exc("Expected location step", path, pos);
+}
+
+// _____________________________________________________________________________
+inline std::string query::parse_name(size_t* pos, bool allow_star) const {
+  size_t start = *pos;
+  if (allow_star && *pos < _path.size() && _path[*pos] == '*') {
+    (*pos)++;
+    return "*";
+  }
+
+  while (*pos < _path.size()) {
+    char c = _path[*pos];
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' &&
+        c != '.' && c != ':') {
+      break;
+    }
+    (*pos)++;
+  }
+
+  if (*pos == start) throw query_exc("Expected name", _path, *pos);
+  return _path.substr(start, *pos - start);
+}
+
+// _____________________________________________________________________________
+inline query_pred query::parse_pred(size_t* pos) const {
+  query_pred p;
+  p.has_val = false;
+
+  if (*pos < _path.size() && _path[*pos] != '@') {
+    p.child = parse_name(pos, true);
+    if (*pos + 1 < _path.size() && _path[*pos] == '/' &&
+        _path[*pos + 1] == '@') {
+      *pos += 2;
+    } else {
+      return p;
+    }
+  } else {
+    (*pos)++;
+  }
+
+  p.attr = parse_name(pos, false);
+
+  if (*pos < _path.size() && _path[*pos] == '=') {
+    (*pos)++;
+    if (*pos >= _path.size() || (_path[*pos] != '\'' && _path[*pos] != '"'))
+      throw query_exc("Expected string literal", _path, *pos);
+    char q = _path[*pos];
+    size_t end = _path.find(q, *pos + 1);
+    if (end == std::string::npos)
+      throw query_exc("Unterminated string literal", _path, *pos);
+    p.val = _path.substr(*pos + 1, end - *pos - 1);
+    p.has_val = true;
+    *pos = end + 1;
+  }
+
+  return p;
+}
+}  // namespace pfxml
+
+#endif  // PFXML_QUERY_H_
@@ -0,0 +1,431 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#ifndef PFXML_TAPE_H_
+#define PFXML_TAPE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+
+namespace pfxml {
+
+// Pre-tokenized event cache. A tape_writer records the events of a first
+// pass over a file, later passes replay them from the mmap'ed tape through
+// the same next()/get()/level()/skip() interface as pfxml::file, without
+// decompressing or tokenizing the input again. The header stores the size
+// and modification time of the source, tape::valid() checks them.
+//
+// Layout (native byte order, records are 8-byte aligned):
+//
+//   header
+//   records, each:
+//     uint64_t skip         offset of the record following the subtree
+//     uint32_t level
+//     uint32_t name         name id, or TAPE_TEXT for text
+//     uint32_t nattrs
+//     uint32_t len          record length including padding
+//     nattrs x { uint32_t key id, value, NUL-terminated }
+//     text, NUL-terminated
+//   name table: names_count NUL-terminated strings
+
+static const char TAPE_MAGIC[8] = {'P', 'F', 'X', 'M', 'L', 'T', 'P', '1'};
+static const uint32_t TAPE_TEXT = 0xFFFFFFFF;
+
+struct tape_header {
+  char magic[8];
+  uint64_t src_size;
+  int64_t src_mtime;
+  int64_t src_mtime_ns;
+  uint64_t events_off;
+  uint64_t events_len;
+  uint64_t names_off;
+  uint64_t names_count;
+};
+
+class tape_exc : public std::exception {
+ public:
+  tape_exc(std::string msg, std::string file) : _msg(file + ": " + msg) {}
+  ~tape_exc() throw() {}
+
+  virtual const char* what() const throw() { return _msg.c_str(); }
+
+ private:
+  std::string _msg;
+};
+
+class tape_writer {
+ public:
+  // write a tape for the source file src to path
+  tape_writer(const std::string& path, const std::string& src);
+  ~tape_writer();
+
+  // record the current event of xml
+  template <typename F>
+  void add(const F& xml);
+
+  // write the name table and the header, the tape is incomplete (and thus
+  // invalid) without it
+  void finish();
+
+ private:
+  std::string _path;
+  int _file;
+  tape_header _hdr;
+  bool _done;
+
+  std::vector<char> _buf;
+  uint64_t _flushed;
+
+  std::unordered_map<std::string, uint32_t> _ids;
+  std::vector<std::string> _names;
+
+  // open elements, (level, record offset)
+  std::vector<std::pair<size_t, uint64_t>> _open;
+
+  uint32_t id(const char* name);
+  void put(const void* p, size_t n);
+  void close_to(size_t level);
+  void patch(uint64_t rec, uint64_t skip);
+  void flush();
+  void write_at(const void* p, size_t n, uint64_t off);
+};
+
+class tape {
+ public:
+  explicit tape(const std::string& path);
+  ~tape();
+
+  // true if the tape at path is complete and was written for the current
+  // version of src
+  static bool valid(const std::string& path, const std::string& src);
+
+  bool next();
+  void skip();
+  void reset();
+  const tag& get() const;
+  size_t level() const;
+
+ private:
+  std::string _path;
+  char* _map;
+  size_t _map_size;
+  const char* _begin;
+  const char* _end;
+  const char* _cur;
+  const char* _skip;
+  std::vector<const char*> _names;
+  tag _ret;
+  size_t _level;
+
+  void corrupt() const;
+};
+
+// _____________________________________________________________________________
+inline tape_writer::tape_writer(const std::string& path, const std::string& src)
+    : _path(path), _done(false), _flushed(0) {
+  struct stat st;
+  if (stat(src.c_str(), &st) != 0)
+    throw tape_exc("could not stat source file", src);
+
+  memset(&_hdr, 0, sizeof(_hdr));
+  _hdr.src_size = st.st_size;
+  _hdr.src_mtime = st.st_mtim.tv_sec;
+  _hdr.src_mtime_ns = st.st_mtim.tv_nsec;
+  _hdr.events_off = sizeof(tape_header);
+
+  _file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (_file < 0) throw tape_exc("could not open file", path);
+
+  // the magic is written last, an unfinished tape is never valid
+  write_at(&_hdr, sizeof(_hdr), 0);
+  _flushed = sizeof(_hdr);
+  _buf.reserve(4 * 1024 * 1024);
+}
+
+// _____________________________________________________________________________
+inline tape_writer::~tape_writer() {
+  if (_file >= 0) close(_file);
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline void tape_writer::add(const F& xml) {
+  const tag& t = xml.get();
+  const attr_map& attrs = t.all_attrs();
+  size_t lvl = xml.level();
+  close_to(lvl);
+
+  uint64_t rec = _flushed + _buf.size();
+  uint32_t hdr[4];
+  hdr[0] = lvl;
+  hdr[1] = *t.name ? id(t.name) : TAPE_TEXT;
+  hdr[2] = attrs.size();
+  hdr[3] = 0;
+
+  uint64_t skip = 0;
+  put(&skip, sizeof(skip));
+  put(hdr, sizeof(hdr));
+  for (const auto& kv : attrs) {
+    uint32_t k = id(kv.first);
+    put(&k, sizeof(k));
+    put(kv.second, strlen(kv.second) + 1);
+  }
+  put(t.text, strlen(t.text) + 1);
+
+  static const char pad[8] = {0};
+  put(pad, (8 - (_flushed + _buf.size()) % 8) % 8);
+
+  // the record is still completely buffered
+  uint32_t len = _flushed + _buf.size() - rec;
+  memcpy(&_buf[rec - _flushed + sizeof(skip) + 3 * sizeof(uint32_t)], &len,
+         sizeof(len));
+
+  // text has no subtree
+  if (*t.name) {
+    _open.push_back({lvl, rec});
+  } else {
+    patch(rec, rec + len);
+  }
+
+  if (_buf.size() >= 4 * 1024 * 1024) flush();
+}
+
+// _____________________________________________________________________________
+inline uint32_t tape_writer::id(const char* name) {
+  auto it = _ids.find(name);
+  if (it != _ids.end()) return it->second;
+  uint32_t id = _names.size();
+  _names.push_back(name);
+  _ids[name] = id;
+  return id;
+}
+
+// _____________________________________________________________________________
+inline void tape_writer::put(const void* p, size_t n) {
+  const char* c = static_cast<const char*>(p);
+  _buf.insert(_buf.end(), c, c + n);
+}
+
+// _____________________________________________________________________________
+inline void tape_writer::close_to(size_t level) {
+  uint64_t end = _flushed + _buf.size();
+  while (!_open.empty() && _open.back().first >= level) {
+    patch(_open.back().second, end);
+    _open.pop_back();
+  }
+}
+
+// _____________________________________________________________________________
+inline void tape_writer::patch(uint64_t rec, uint64_t skip) {
+  if (rec >= _flushed) {
+    memcpy(&_buf[rec - _flushed], &skip, sizeof(skip));
+  } else {
+    write_at(&skip, sizeof(skip), rec);
+  }
+}
+
+// _____________________________________________________________________________
+inline void tape_writer::flush() {
+  write_at(_buf.data(), _buf.size(), _flushed);
+  _flushed += _buf.size();
+  _buf.clear();
+}
+
+// _____________________________________________________________________________
+inline void tape_writer::write_at(const void* p, size_t n, uint64_t off) {
+  const char* c = static_cast<const char*>(p);
+  while (n) {
+    ssize_t w = pwrite(_file, c, n, off);
+    if (w < 0) throw tape_exc("could not write to file", _path);
+    c += w;
+    n -= w;
+    off += w;
+  }
+}
+
+// _____________________________________________________________________________
+inline void tape_writer::finish() {
+  if (_done) return;
+  _done = true;
+  close_to(0);
+
+  _hdr.events_len = _flushed + _buf.size() - _hdr.events_off;
+  _hdr.names_off = _flushed + _buf.size();
+  _hdr.names_count = _names.size();
+  for (const auto& n : _names) put(n.c_str(), n.size() + 1);
+  flush();
+
+  memcpy(_hdr.magic, TAPE_MAGIC, sizeof(TAPE_MAGIC));
+  write_at(&_hdr, sizeof(_hdr), 0);
+
+  if (close(_file) != 0) throw tape_exc("could not close file", _path);
+  _file = -1;
+}
+
+// _____________________________________________________________________________
+inline bool tape::valid(const std::string& path, const std::string& src) {
+  struct stat st;
+  if (stat(src.c_str(), &st) != 0) return false;
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  tape_header hdr;
+  ssize_t r = pread(fd, &hdr, sizeof(hdr), 0);
+  close(fd);
+
+  return r == sizeof(hdr) &&
+         memcmp(hdr.magic, TAPE_MAGIC, sizeof(TAPE_MAGIC)) == 0 &&
+         hdr.src_size == uint64_t(st.st_size) &&
+         hdr.src_mtime == st.st_mtim.tv_sec &&
+         hdr.src_mtime_ns == st.st_mtim.tv_nsec;
+}
+
+// _____________________________________________________________________________
+inline tape::tape(const std::string& path) : _path(path), _map(0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw tape_exc("could not open file", path);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(tape_header)) {
+    close(fd);
+    throw tape_exc("not a valid tape", path);
+  }
+
+  _map_size = st.st_size;
+  void* m = mmap(0, _map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) throw tape_exc("could not map file", path);
+  _map = static_cast<char*>(m);
+#ifdef MADV_SEQUENTIAL
+  madvise(_map, _map_size, MADV_SEQUENTIAL);
+#endif
+
+  tape_header hdr;
+  memcpy(&hdr, _map, sizeof(hdr));
+  bool ok = memcmp(hdr.magic, TAPE_MAGIC, sizeof(TAPE_MAGIC)) == 0 &&
+            hdr.events_off >= sizeof(tape_header) && hdr.events_off % 8 == 0 &&
+            hdr.events_off <= _map_size &&
+            hdr.events_len <= _map_size - hdr.events_off &&
+            hdr.names_off >= hdr.events_off + hdr.events_len &&
+            hdr.names_off <= _map_size;
+
+  // all names have to be NUL-terminated within the map
+  const char* n = ok ? _map + hdr.names_off : _map;
+  const char* end = _map + _map_size;
+  for (uint64_t i = 0; ok && i < hdr.names_count; i++) {
+    const char* e = static_cast<const char*>(memchr(n, 0, end - n));
+    if (!e) {
+      ok = false;
+      break;
+    }
+    _names.push_back(n);
+    n = e + 1;
+  }
+
+  if (!ok) {
+    munmap(_map, _map_size);
+    throw tape_exc("not a valid tape", path);
+  }
+
+  _begin = _map + hdr.events_off;
+  _end = _begin + hdr.events_len;
+
+  reset();
+}
+
+// _____________________________________________________________________________
+inline tape::~tape() { munmap(_map, _map_size); }
+
+// _____________________________________________________________________________
+inline void tape::reset() {
+  _cur = _begin;
+  _skip = 0;
+  _level = 0;
+  _ret.name = "";
+  _ret.text = "";
+  _ret.attrs.clear();
+}
+
+// _____________________________________________________________________________
+inline const tag& tape::get() const { return _ret; }
+
+// _____________________________________________________________________________
+inline size_t tape::level() const { return _level; }
+
+// _____________________________________________________________________________
+inline void tape::skip() {
+  if (_skip) _cur = _skip;
+  _skip = 0;
+}
+
+// _____________________________________________________________________________
+inline bool tape::next() {
+  _ret.attrs.clear();
+  _skip = 0;
+
+  if (_cur >= _end) {
+    _ret.name = "[root]";
+    _ret.text = "";
+    _level = 0;
+    return false;
+  }
+
+  // records are checked as they are read, a corrupt tape throws instead of
+  // reading outside of the map
+  uint64_t skip;
+  uint32_t hdr[4];
+  if (size_t(_end - _cur) < sizeof(skip) + sizeof(hdr)) corrupt();
+  memcpy(&skip, _cur, sizeof(skip));
+  memcpy(hdr, _cur + sizeof(skip), sizeof(hdr));
+
+  // a record ends with the NUL of its text or padding, no string can thus
+  // run past its end
+  const char* rec_end = _cur + hdr[3];
+  if (hdr[3] <= sizeof(skip) + sizeof(hdr) || hdr[3] % 8 ||
+      hdr[3] > size_t(_end - _cur) || rec_end[-1]) {
+    corrupt();
+  }
+  if (hdr[1] != TAPE_TEXT && hdr[1] >= _names.size()) corrupt();
+
+  const char* p = _cur + sizeof(skip) + sizeof(hdr);
+  for (uint32_t i = 0; i < hdr[2]; i++) {
+    uint32_t k;
+    if (size_t(rec_end - p) <= sizeof(k)) corrupt();
+    memcpy(&k, p, sizeof(k));
+    if (k >= _names.size()) corrupt();
+    p += sizeof(k);
+    _ret.attrs.push_back({_names[k], p});
+    p += strlen(p) + 1;
+  }
+  if (p >= rec_end) corrupt();
+
+  _level = hdr[0];
+  _ret.name = hdr[1] == TAPE_TEXT ? "" : _names[hdr[1]];
+  _ret.text = p;
+
+  if (hdr[1] != TAPE_TEXT) {
+    // the subtree ends behind the record and within the events
+    if (skip < uint64_t(rec_end - _map) || skip > uint64_t(_end - _map)) {
+      corrupt();
+    }
+    _skip = _map + skip;
+  }
+  _cur = rec_end;
+  return true;
+}
+
+// _____________________________________________________________________________
+inline void tape::corrupt() const { throw tape_exc("corrupt tape", _path); }
+}  // namespace pfxml
+
+#endif  // PFXML_TAPE_H_
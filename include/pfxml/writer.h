@@ -0,0 +1,543 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#ifndef PFXML_WRITER_H_
+#define PFXML_WRITER_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef PFXML_NO_ZLIB
+#include <zlib.h>
+#endif
+
+#ifndef PFXML_NO_BZLIB
+#include <bzlib.h>
+#endif
+
+#ifdef PFXML_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <cstring>
+#include <deque>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+
+namespace pfxml {
+
+static const size_t WRITE_BUFFER_S = 4 * 1024 * 1024;
+
+class write_exc : public std::exception {
+ public:
+  write_exc(std::string msg, std::string file) : _msg(file + ": " + msg) {}
+  ~write_exc() throw() {}
+
+  virtual const char* what() const throw() { return _msg.c_str(); }
+
+ private:
+  std::string _msg;
+};
+
+// Streaming XML writer. Output is buffered and optionally compressed, the
+// compression is determined by the file extension (.gz, .bz2, .zst) unless
+// given explicitly. A path of "-" writes to stdout. With threads > 1, gzip
+// output is compressed in parallel as a sequence of independent gzip members
+// and zstd output uses zstd's own worker threads.
+//
+// Strings passed to attr() and text() are escaped, strings passed to the
+// *_raw() functions and to copy() are written verbatim. As pfxml never
+// decodes the input, the strings of a parsed tag can be written back
+// unmodified.
+class writer {
+ public:
+  explicit writer(const std::string& path, size_t threads = 1);
+  writer(const std::string& path, compression c, size_t threads = 1);
+  ~writer();
+
+  // write the XML declaration
+  void decl();
+
+  // open a new element, attributes may follow until content is written
+  void open(const char* name);
+  void attr(const char* k, const char* v);
+  void attr_raw(const char* k, const char* v);
+
+  void text(const char* t);
+  void text_raw(const char* t);
+
+  // close the innermost open element
+  void close();
+
+  // write a parsed event verbatim at the given level, closing all open
+  // elements at the same or a deeper level first
+  void copy(const tag& t, size_t level);
+
+  // write raw bytes
+  void raw(const char* s, size_t n);
+
+  // close all open elements, flush and close the output. Called by the
+  // destructor, which swallows errors
+  void finish();
+
+  // the current element depth
+  size_t level() const;
+
+  static std::string escape(const char* str, bool attr);
+
+ private:
+  std::string _path;
+  compression _comp;
+  size_t _threads;
+  int _file;
+  bool _done;
+
+  char* _buf;
+  size_t _len;
+
+  std::vector<std::string> _stack;
+  bool _in_start;
+
+#ifndef PFXML_NO_ZLIB
+  z_stream _z;
+  std::deque<std::future<std::string>> _jobs;
+#endif
+#ifndef PFXML_NO_BZLIB
+  bz_stream _bz;
+#endif
+#ifdef PFXML_ZSTD
+  ZSTD_CCtx* _zstd;
+#endif
+
+  std::vector<char> _out;
+
+  void init();
+  void end_comp();
+  void put(const char* s, size_t n);
+  void put(char c);
+  void put_esc(const char* s, size_t n, bool attr);
+  void end_start();
+  void flush(bool last);
+  void write_out(const char* s, size_t n);
+
+#ifndef PFXML_NO_ZLIB
+  static std::string gz_member(const std::string& in,
+                               const std::string& path);
+#endif
+};
+
+// _____________________________________________________________________________
+inline writer::writer(const std::string& path, size_t threads)
+    : _path(path), _comp(PLAIN), _threads(threads) {
+  size_t n = path.size();
+  if (n > 3 && path.compare(n - 3, 3, ".gz") == 0) {
+    _comp = GZIP;
+  } else if (n > 4 && path.compare(n - 4, 4, ".bz2") == 0) {
+    _comp = BZIP2;
+  } else if (n > 4 && path.compare(n - 4, 4, ".zst") == 0) {
+    _comp = ZSTD;
+  }
+  init();
+}
+
+// _____________________________________________________________________________
+inline writer::writer(const std::string& path, compression c, size_t threads)
+    : _path(path), _comp(c), _threads(threads) {
+  init();
+}
+
+// _____________________________________________________________________________
+inline void writer::init() {
+  _done = false;
+  _len = 0;
+  _in_start = false;
+  if (_threads < 1) _threads = 1;
+
+  if (_comp == GZIP) {
+#ifndef PFXML_NO_ZLIB
+    memset(&_z, 0, sizeof(_z));
+    // windowBits 15 + 16 writes a gzip header
+    if (_threads == 1 && deflateInit2(&_z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                      15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw write_exc("could not initialize gzip compression", _path);
+#else
+    throw write_exc("could not write gzip file, pfxml was compiled without "
+                    "zlib support",
+                    _path);
+#endif
+  } else if (_comp == BZIP2) {
+#ifndef PFXML_NO_BZLIB
+    memset(&_bz, 0, sizeof(_bz));
+    if (BZ2_bzCompressInit(&_bz, 9, 0, 0) != BZ_OK)
+      throw write_exc("could not initialize bzip compression", _path);
+#else
+    throw write_exc("could not write bzip file, pfxml was compiled without "
+                    "bzlib support",
+                    _path);
+#endif
+  } else if (_comp == ZSTD) {
+#ifdef PFXML_ZSTD
+    _zstd = ZSTD_createCCtx();
+    if (!_zstd) throw write_exc("could not initialize zstd compression", _path);
+    // fails silently if zstd was built without multithreading support
+    if (_threads > 1)
+      ZSTD_CCtx_setParameter(_zstd, ZSTD_c_nbWorkers, _threads);
+#else
+    throw write_exc("could not write zstd file, pfxml was compiled without "
+                    "zstd support (define PFXML_ZSTD)",
+                    _path);
+#endif
+  }
+
+  _file = -1;
+  try {
+    if (_path == "-") {
+      _file = 1;
+    } else {
+      _file = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (_file < 0) throw write_exc("could not open file", _path);
+    }
+
+    _buf = new char[WRITE_BUFFER_S];
+  } catch (...) {
+    // the destructor does not run if the constructor throws
+    if (_file >= 0 && _path != "-") ::close(_file);
+    end_comp();
+    throw;
+  }
+}
+
+// _____________________________________________________________________________
+inline void writer::end_comp() {
+#ifndef PFXML_NO_ZLIB
+  if (_comp == GZIP && _threads == 1) deflateEnd(&_z);
+#endif
+#ifndef PFXML_NO_BZLIB
+  if (_comp == BZIP2) BZ2_bzCompressEnd(&_bz);
+#endif
+#ifdef PFXML_ZSTD
+  if (_comp == ZSTD) ZSTD_freeCCtx(_zstd);
+#endif
+}
+
+// _____________________________________________________________________________
+inline writer::~writer() {
+  try {
+    finish();
+  } catch (...) {
+  }
+  delete[] _buf;
+}
+
+// _____________________________________________________________________________
+inline size_t writer::level() const { return _stack.size(); }
+
+// _____________________________________________________________________________
+inline void writer::decl() {
+  static const char d[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+  put(d, sizeof(d) - 1);
+}
+
+// _____________________________________________________________________________
+inline void writer::open(const char* name) {
+  end_start();
+  put('<');
+  put(name, strlen(name));
+  _stack.push_back(name);
+  _in_start = true;
+}
+
+// _____________________________________________________________________________
+inline void writer::attr(const char* k, const char* v) {
+  assert(_in_start);
+  put(' ');
+  put(k, strlen(k));
+  put("=\"", 2);
+  put_esc(v, strlen(v), true);
+  put('"');
+}
+
+// _____________________________________________________________________________
+inline void writer::attr_raw(const char* k, const char* v) {
+  assert(_in_start);
+  put(' ');
+  put(k, strlen(k));
+  // a raw value may contain the double quote, but never both quote chars
+  char q = strchr(v, '"') ? '\'' : '"';
+  put('=');
+  put(q);
+  put(v, strlen(v));
+  put(q);
+}
+
+// _____________________________________________________________________________
+inline void writer::text(const char* t) {
+  end_start();
+  put_esc(t, strlen(t), false);
+}
+
+// _____________________________________________________________________________
+inline void writer::text_raw(const char* t) {
+  end_start();
+  put(t, strlen(t));
+}
+
+// _____________________________________________________________________________
+inline void writer::close() {
+  assert(!_stack.empty());
+  if (_in_start) {
+    put("/>", 2);
+    _in_start = false;
+  } else {
+    put("</", 2);
+    put(_stack.back().data(), _stack.back().size());
+    put('>');
+  }
+  _stack.pop_back();
+  if (_stack.empty()) put('\n');
+}
+
+// _____________________________________________________________________________
+inline void writer::copy(const tag& t, size_t level) {
+  // the parent of an event at level l is at depth l - 1
+  while (_stack.size() >= level) close();
+
+  if (!*t.name) {
+    text_raw(t.text);
+    return;
+  }
+
+  open(t.name);
+  for (const auto& kv : t.all_attrs()) attr_raw(kv.first, kv.second);
+}
+
+// _____________________________________________________________________________
+inline void writer::raw(const char* s, size_t n) {
+  end_start();
+  put(s, n);
+}
+
+// _____________________________________________________________________________
+inline void writer::end_start() {
+  if (!_in_start) return;
+  put('>');
+  _in_start = false;
+}
+
+// _____________________________________________________________________________
+inline void writer::put(char c) {
+  if (_len == WRITE_BUFFER_S) flush(false);
+  _buf[_len++] = c;
+}
+
+// _____________________________________________________________________________
+inline void writer::put(const char* s, size_t n) {
+  while (n) {
+    if (_len == WRITE_BUFFER_S) flush(false);
+    size_t m = std::min(n, WRITE_BUFFER_S - _len);
+    memcpy(_buf + _len, s, m);
+    _len += m;
+    s += m;
+    n -= m;
+  }
+}
+
+// _____________________________________________________________________________
+inline void writer::put_esc(const char* s, size_t n, bool attr) {
+  const char* end = s + n;
+
+  while (s < end) {
+    // copy the longest prefix which needs no escaping
+    const char* p = s;
+#ifdef __SSE2__
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i quot = _mm_set1_epi8(attr ? '"' : '&');
+    while (end - p >= 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      __m128i m = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+          _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, quot)));
+      int mask = _mm_movemask_epi8(m);
+      if (mask) {
+        p += __builtin_ctz(mask);
+        break;
+      }
+      p += 16;
+    }
+#endif
+    while (p < end && *p != '<' && *p != '>' && *p != '&' &&
+           !(attr && *p == '"')) {
+      p++;
+    }
+
+    put(s, p - s);
+    if (p == end) return;
+
+    switch (*p) {
+      case '<':
+        put("&lt;", 4);
+        break;
+      case '>':
+        put("&gt;", 4);
+        break;
+      case '&':
+        put("&amp;", 5);
+        break;
+      default:
+        put("&quot;", 6);
+    }
+    s = p + 1;
+  }
+}
+
+// _____________________________________________________________________________
+inline std::string writer::escape(const char* str, bool attr) {
+  std::string ret;
+  for (const char* p = str; *p; p++) {
+    switch (*p) {
+      case '<':
+        ret += "&lt;";
+        break;
+      case '>':
+        ret += "&gt;";
+        break;
+      case '&':
+        ret += "&amp;";
+        break;
+      case '"':
+        if (attr) {
+          ret += "&quot;";
+          break;
+        }
+        // fall through
+      default:
+        ret += *p;
+    }
+  }
+  return ret;
+}
+
+// _____________________________________________________________________________
+inline void writer::finish() {
+  if (_done) return;
+  _done = true;
+  while (!_stack.empty()) close();
+  flush(true);
+#ifdef PFXML_ZSTD
+  if (_comp == ZSTD) ZSTD_freeCCtx(_zstd);
+#endif
+  if (_file != 1 && ::close(_file) != 0)
+    throw write_exc("could not close file", _path);
+}
+
+// _____________________________________________________________________________
+inline void writer::flush(bool last) {
+  if (!_len && !last) return;
+
+  const size_t chunk = 1024 * 1024;
+  if (_out.size() < chunk) _out.resize(chunk);
+
+  if (_comp == PLAIN) {
+    write_out(_buf, _len);
+  } else if (_comp == GZIP) {
+#ifndef PFXML_NO_ZLIB
+    if (_threads > 1) {
+      if (_len) {
+        _jobs.push_back(std::async(std::launch::async, gz_member,
+                                   std::string(_buf, _len), _path));
+      }
+      while (!_jobs.empty() && (last || _jobs.size() >= _threads)) {
+        std::string out = _jobs.front().get();
+        _jobs.pop_front();
+        write_out(out.data(), out.size());
+      }
+    } else {
+      _z.next_in = reinterpret_cast<Bytef*>(_buf);
+      _z.avail_in = _len;
+      int ret;
+      do {
+        _z.next_out = reinterpret_cast<Bytef*>(_out.data());
+        _z.avail_out = _out.size();
+        ret = deflate(&_z, last ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR)
+          throw write_exc("gzip compression failed", _path);
+        write_out(_out.data(), _out.size() - _z.avail_out);
+      } while (_z.avail_out == 0 || (last && ret != Z_STREAM_END));
+      if (last) deflateEnd(&_z);
+    }
+#endif
+  } else if (_comp == BZIP2) {
+#ifndef PFXML_NO_BZLIB
+    _bz.next_in = _buf;
+    _bz.avail_in = _len;
+    int ret;
+    do {
+      _bz.next_out = _out.data();
+      _bz.avail_out = _out.size();
+      ret = BZ2_bzCompress(&_bz, last ? BZ_FINISH : BZ_RUN);
+      if (ret < 0) throw write_exc("bzip compression failed", _path);
+      write_out(_out.data(), _out.size() - _bz.avail_out);
+    } while (_bz.avail_in || (last && ret != BZ_STREAM_END));
+    if (last) BZ2_bzCompressEnd(&_bz);
+#endif
+  } else if (_comp == ZSTD) {
+#ifdef PFXML_ZSTD
+    ZSTD_inBuffer in = {_buf, _len, 0};
+    size_t rem;
+    do {
+      ZSTD_outBuffer out = {_out.data(), _out.size(), 0};
+      rem = ZSTD_compressStream2(_zstd, &out, &in,
+                                 last ? ZSTD_e_end : ZSTD_e_continue);
+      if (ZSTD_isError(rem))
+        throw write_exc(ZSTD_getErrorName(rem), _path);
+      write_out(_out.data(), out.pos);
+    } while (in.pos < in.size || (last && rem));
+#endif
+  }
+
+  _len = 0;
+}
+
+// _____________________________________________________________________________
+inline void writer::write_out(const char* s, size_t n) {
+  while (n) {
+    ssize_t w = write(_file, s, n);
+    if (w < 0) throw write_exc("could not write to file", _path);
+    s += w;
+    n -= w;
+  }
+}
+
+#ifndef PFXML_NO_ZLIB
+// _____________________________________________________________________________
+inline std::string writer::gz_member(const std::string& in,
+                                     const std::string& path) {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    throw write_exc("could not initialize gzip compression", path);
+  std::string out(deflateBound(&z, in.size()), 0);
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  z.avail_in = in.size();
+  z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  z.avail_out = out.size();
+  // the output fits into deflateBound(), a single call finishes the member
+  int ret = deflate(&z, Z_FINISH);
+  deflateEnd(&z);
+  if (ret != Z_STREAM_END) throw write_exc("gzip compression failed", path);
+  out.resize(out.size() - z.avail_out);
+  return out;
+}
+#endif
+}  // namespace pfxml
+
+#endif  // PFXML_WRITER_H_
@@ -0,0 +1,206 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+#include "test.h"
+
+using pfxml::test::dump;
+using pfxml::test::dump_push;
+using pfxml::test::tmp_file;
+
+struct utf8_policy : pfxml::default_policy {
+  static const bool utf8 = true;
+};
+
+// _____________________________________________________________________________
+std::string to_utf8(const std::u32string& s) {
+  std::string ret;
+  for (char32_t c : s) {
+    if (c < 0x80) {
+      ret += static_cast<char>(c);
+    } else if (c < 0x800) {
+      ret += static_cast<char>(0xC0 | (c >> 6));
+      ret += static_cast<char>(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+      ret += static_cast<char>(0xE0 | (c >> 12));
+      ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+      ret += static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+      ret += static_cast<char>(0xF0 | (c >> 18));
+      ret += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+      ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+      ret += static_cast<char>(0x80 | (c & 0x3F));
+    }
+  }
+  return ret;
+}
+
+// _____________________________________________________________________________
+std::string to_utf16(const std::u32string& s, bool be) {
+  std::string ret = be ? "\xFE\xFF" : "\xFF\xFE";
+  auto unit = [&](uint16_t u) {
+    ret += static_cast<char>(be ? u >> 8 : u & 0xFF);
+    ret += static_cast<char>(be ? u & 0xFF : u >> 8);
+  };
+  for (char32_t c : s) {
+    if (c < 0x10000) {
+      unit(c);
+    } else {
+      unit(0xD800 | ((c - 0x10000) >> 10));
+      unit(0xDC00 | ((c - 0x10000) & 0x3FF));
+    }
+  }
+  return ret;
+}
+
+// single-byte encodings, cp1252 maps the bytes 0x80 to 0x9F differently
+// _____________________________________________________________________________
+std::string to_8bit(const std::u32string& s, bool cp1252) {
+  std::string ret;
+  for (char32_t c : s) {
+    unsigned char b = c;
+    for (size_t i = 0; cp1252 && i < 32; i++) {
+      if (pfxml::CP1252_HIGH[i] == c) b = 0x80 + i;
+    }
+    ret += static_cast<char>(b);
+  }
+  return ret;
+}
+
+// a document with non-ASCII chars at every alignment, larger than the
+// initial buffers if n is large
+// _____________________________________________________________________________
+std::u32string doc(size_t n, bool bmp_only, bool cp1252) {
+  std::u32string uni = U"äöß";
+  if (!bmp_only) uni += U"€\U0001D11E中";
+  if (cp1252) uni += U"€œ™";
+
+  std::u32string ret = U"<r a=\"" + uni + U"\">";
+  for (size_t i = 0; i < n; i++) {
+    ret += U"<e v='" + std::u32string(i % 5, U'x') + uni + U"'>" +
+           std::u32string(i % 3, U'y') + uni + U" &amp; " + uni + U"</e>";
+  }
+  return ret + U"</r>";
+}
+
+// _____________________________________________________________________________
+template <typename P>
+void check_encoded(const std::string& name, const std::string& in,
+                   const std::string& utf8, pfxml::encoding enc,
+                   size_t feed) {
+  pfxml::file ref(utf8.size() + 1);
+  std::string exp = dump_push(&ref, utf8, utf8.size(), true, true);
+
+  tmp_file tmp(in);
+  pfxml::basic_file<P> pull(tmp.path());
+  std::string got = dump(&pull);
+  if (got != exp) std::cerr << name << ": file" << std::endl;
+  PFXML_CHECK_EQ(got, exp);
+  PFXML_CHECK_EQ(pull.input_encoding(), enc);
+
+  pfxml::basic_file<P> push;
+  got = dump_push(&push, in, feed, true, true, 64);
+  if (got != exp) std::cerr << name << ": push" << std::endl;
+  PFXML_CHECK_EQ(got, exp);
+  PFXML_CHECK_EQ(push.input_encoding(), enc);
+}
+
+// _____________________________________________________________________________
+void check_all(const std::string& name, const std::string& in,
+               const std::string& utf8, pfxml::encoding enc, size_t feed) {
+  check_encoded<pfxml::default_policy>(name, in, utf8, enc, feed);
+  check_encoded<utf8_policy>(name, in, utf8, enc, feed);
+}
+
+// _____________________________________________________________________________
+void test_transcoding() {
+  for (size_t n : {20, 20000}) {
+    // large documents are fed in odd pieces which split chars
+    size_t feed = n < 100 ? 1 : 7;
+    std::string sz = std::to_string(n);
+
+    std::u32string d = doc(n, false, false);
+    std::string u8 = to_utf8(d);
+    check_all("utf-8 " + sz, u8, u8, pfxml::UTF8, feed);
+    check_all("utf-8 bom " + sz, "\xEF\xBB\xBF" + u8, u8, pfxml::UTF8, feed);
+    check_all("utf-16le " + sz, to_utf16(d, false), u8, pfxml::UTF16LE,
+              feed);
+    check_all("utf-16be " + sz, to_utf16(d, true), u8, pfxml::UTF16BE, feed);
+
+    // without a byte order mark
+    check_all("utf-16le no bom " + sz, to_utf16(d, false).substr(2), u8,
+              pfxml::UTF16LE, feed);
+    check_all("utf-16be no bom " + sz, to_utf16(d, true).substr(2), u8,
+              pfxml::UTF16BE, feed);
+
+    // the reference is parsed from UTF-8 without the declaration
+    std::u32string l1 = doc(n, true, false);
+    check_all("latin-1 " + sz,
+              to_8bit(U"<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>\n" +
+                          l1,
+                      false),
+              to_utf8(l1), pfxml::LATIN1, feed);
+
+    std::u32string cp = doc(n, true, true);
+    check_all("cp1252 " + sz,
+              to_8bit(U"<?xml version='1.0' encoding='windows-1252'?>\n" + cp,
+                      true),
+              to_utf8(cp), pfxml::CP1252, feed);
+  }
+}
+
+// _____________________________________________________________________________
+template <typename P>
+bool throws(const std::string& in) {
+  tmp_file tmp(in);
+  try {
+    pfxml::basic_file<P> xml(tmp.path());
+    while (xml.next()) {
+    }
+  } catch (const pfxml::parse_exc& e) {
+    return true;
+  }
+  return false;
+}
+
+// _____________________________________________________________________________
+void test_invalid() {
+  PFXML_CHECK(throws<pfxml::default_policy>(
+      "<?xml version='1.0' encoding='koi8-r'?><r/>"));
+
+  const std::vector<std::string> bad = {
+      "\xC0\xAF",          // overlong
+      "\xE2\x82",          // truncated
+      "\x80",              // lone continuation byte
+      "\xED\xA0\x80",      // surrogate
+      "\xF4\x90\x80\x80",  // beyond U+10FFFF
+  };
+
+  // invalid sequences are found in attributes, in text and across the
+  // buffer boundary, and only with the utf8 switch
+  std::string pad(pfxml::INIT_BUFFER_S - 12, 'p');
+  for (const auto& b : bad) {
+    const std::vector<std::string> docs = {
+        "<r a='" + b + "'/>", "<r>" + b + "</r>",
+        "<r><p>" + pad + "</p>" + b + "</r>",
+        "<r><p>" + pad + "x</p>" + b + "</r>"};
+    for (const auto& d : docs) {
+      PFXML_CHECK(throws<utf8_policy>(d));
+      PFXML_CHECK(!throws<pfxml::default_policy>(d));
+    }
+  }
+
+  PFXML_CHECK(
+      !throws<utf8_policy>("<r a='\xF0\x9D\x84\x9E'>\xE2\x82\xAC</r>"));
+}
+
+// _____________________________________________________________________________
+int main() {
+  test_transcoding();
+  test_invalid();
+  return pfxml::test::result("encoding_test");
+}
@@ -0,0 +1,94 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+#include "test.h"
+
+using pfxml::test::dump;
+using pfxml::test::dump_push;
+
+struct lenient_case {
+  std::string xml;
+  std::string events;
+  std::vector<std::string> errors;
+};
+
+// _____________________________________________________________________________
+template <typename P>
+void check_case(const lenient_case& c) {
+  std::vector<std::string> reported;
+
+  pfxml::basic_file<P> pull;
+  pull.open(c.xml.data(), c.xml.size());
+  pull.set_lenient(true, 0, [&](const pfxml::parse_error& e) {
+    reported.push_back(e.msg);
+  });
+  std::string got = dump(&pull, true, true);
+  if (got != c.events) std::cerr << c.xml << ": pull" << std::endl;
+  PFXML_CHECK_EQ(got, c.events);
+  PFXML_CHECK_EQ(pull.error_count(), c.errors.size());
+  PFXML_CHECK(reported == c.errors);
+  for (size_t i = 0; i < pull.errors().size() && i < c.errors.size(); i++)
+    PFXML_CHECK_EQ(pull.errors()[i].msg, c.errors[i]);
+
+  // single-byte feeds recover the same way
+  pfxml::basic_file<P> push;
+  push.set_lenient(true);
+  got = dump_push(&push, c.xml, 1, true, true);
+  if (got != c.events) std::cerr << c.xml << ": push" << std::endl;
+  PFXML_CHECK_EQ(got, c.events);
+  PFXML_CHECK_EQ(push.error_count(), c.errors.size());
+
+  // and without the lenient mode, the input is rejected
+  pfxml::basic_file<P> strict;
+  strict.open(c.xml.data(), c.xml.size());
+  bool thrown = false;
+  try {
+    while (strict.next()) {
+    }
+  } catch (const pfxml::parse_exc& e) {
+    thrown = true;
+  }
+  PFXML_CHECK(thrown);
+}
+
+// _____________________________________________________________________________
+int main() {
+  const std::vector<lenient_case> cases = {
+      // a '<' which does not start a tag is skipped on its own
+      {"<osm><a>x < y</a><c/><d/><e/></osm>",
+       "1 <osm> []\n2 <a> []\n3 <> [x ]\n2 <c> []\n2 <d> []\n2 <e> []\n",
+       {"Expected valid tag"}},
+      {"<a>text<</a>", "1 <a> []\n2 <> [text]\n", {"Expected valid tag"}},
+      {"<osm><a>1<<b/></a><c/></osm>",
+       "1 <osm> []\n2 <a> []\n3 <> [1]\n3 <b> []\n2 <c> []\n",
+       {"Expected valid tag"}},
+
+      // closing tags without a matching open element
+      {"<osm><way><nd></way><node/></osm>",
+       "1 <osm> []\n2 <way> []\n3 <nd> []\n2 <node> []\n",
+       {"Closing wrong tag '<way>', expected close of '<nd>'."}},
+      {"<osm><a/></b><c/></osm>", "1 <osm> []\n2 <a> []\n2 <c> []\n",
+       {"Closing wrong tag '<b>', expected close of '<osm>'."}},
+
+      // broken tags and declarations
+      {"<osm><a><!x foo><b/></a><c/></osm>",
+       "1 <osm> []\n2 <a> []\n3 <b> []\n2 <c> []\n", {"Expected comment"}},
+      {"<osm><a></a x><c/></osm>", "1 <osm> []\n2 <a> []\n2 <c> []\n",
+       {"Expected '>'"}},
+
+      // content after the root element and truncated input
+      {"<osm><a></a></osm>junk<x/>", "1 <osm> []\n2 <a> []\n",
+       {"No text allowed here."}},
+      {"<osm><node id=\"1\"><tag k=\"a\"",
+       "1 <osm> []\n2 <node> id=[1] []\n", {"XML tree not complete"}},
+  };
+
+  for (const auto& c : cases) check_case<pfxml::default_policy>(c);
+
+  return pfxml::test::result("lenient_test");
+}
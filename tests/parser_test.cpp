@@ -0,0 +1,235 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+#include "test.h"
+
+using pfxml::test::dump;
+using pfxml::test::dump_push;
+using pfxml::test::tmp_file;
+
+// policies with a single switch changed
+struct no_validate_policy : pfxml::default_policy {
+  static const bool validate = false;
+};
+struct no_text_policy : pfxml::default_policy {
+  static const bool text = false;
+};
+struct no_meta_policy : pfxml::default_policy {
+  static const bool meta = false;
+};
+struct no_attrs_policy : pfxml::default_policy {
+  static const bool attrs = false;
+};
+struct utf8_policy : pfxml::default_policy {
+  static const bool utf8 = true;
+};
+struct lazy_policy : pfxml::default_policy {
+  static const bool lazy = true;
+};
+struct offsets_policy : pfxml::default_policy {
+  static const bool offsets = true;
+};
+struct trusted_lazy_policy : pfxml::trusted_policy {
+  static const bool attrs = true;
+  static const bool lazy = true;
+};
+
+// the events of xml parsed with the default policy in push mode from a
+// single buffer which holds the whole document, i.e. without any refill
+// _____________________________________________________________________________
+std::string reference(const std::string& xml, bool text, bool attrs) {
+  pfxml::file ref(xml.size() + 1);
+  return dump_push(&ref, xml, xml.size(), text, attrs);
+}
+
+// parse xml from a file, from memory and in push mode in pieces of feed
+// bytes with a buffer of push_buf bytes, and compare the events against the
+// reference
+// _____________________________________________________________________________
+template <typename P>
+void check_doc(const std::string& name, const std::string& xml, size_t feed,
+               size_t push_buf) {
+  typedef pfxml::basic_file<P> file;
+  std::string exp = reference(xml, P::text, P::attrs);
+
+  tmp_file tmp(xml);
+  file pull(tmp.path());
+  std::string got = dump(&pull);
+  if (got != exp) std::cerr << name << ": file" << std::endl;
+  PFXML_CHECK_EQ(got, exp);
+
+  file mem;
+  mem.open(xml.data(), xml.size());
+  got = dump(&mem);
+  if (got != exp) std::cerr << name << ": memory" << std::endl;
+  PFXML_CHECK_EQ(got, exp);
+
+  file push(push_buf);
+  got = dump_push(&push, xml, feed, P::text, P::attrs);
+  if (got != exp) std::cerr << name << ": push" << std::endl;
+  PFXML_CHECK_EQ(got, exp);
+}
+
+// _____________________________________________________________________________
+template <typename P>
+void check_all(const std::string& name, const std::string& xml, size_t feed,
+               size_t push_buf) {
+  check_doc<P>(name, xml, feed, push_buf);
+}
+
+// _____________________________________________________________________________
+template <typename P, typename Q, typename... R>
+void check_all(const std::string& name, const std::string& xml, size_t feed,
+               size_t push_buf) {
+  check_doc<P>(name, xml, feed, push_buf);
+  check_all<Q, R...>(name, xml, feed, push_buf);
+}
+
+// _____________________________________________________________________________
+void check_policies(const std::string& name, const std::string& xml,
+                    size_t feed, size_t push_buf = pfxml::PUSH_BUFFER_S) {
+  check_all<pfxml::default_policy, no_validate_policy, no_text_policy,
+            no_meta_policy, no_attrs_policy, utf8_policy, lazy_policy,
+            offsets_policy, pfxml::trusted_policy, trusted_lazy_policy>(
+      name, xml, feed, push_buf);
+}
+
+// a document in which construct starts at the given input offset
+// _____________________________________________________________________________
+std::string doc_at(const std::string& construct, size_t at) {
+  std::string head = "<r><p>";
+  std::string pad = "</p>";
+  return head + std::string(at - head.size() - pad.size(), 'x') + pad +
+         construct + "<z k=\"v\">end</z></r>";
+}
+
+// constructs which straddle the first buffer boundary at every offset
+// _____________________________________________________________________________
+void test_boundaries() {
+  const std::vector<std::string> constructs = {
+      "<e a=\"1\" bb='x&amp;y' c = \"3\">some text</e>",
+      "<e/><f /><g\n/>",
+      "<e>a&lt;b &#x41;</e>",
+      "<!-- a comment - with a dash --><e/>",
+      "<!----><e/>",
+      "<?pi some data?><e/>",
+      "<longer-name.with_chars a='&quot;'></longer-name.with_chars >",
+  };
+
+  for (const auto& c : constructs) {
+    for (size_t k = 0; k <= c.size() + 1; k++) {
+      size_t at = pfxml::INIT_BUFFER_S - k;
+      check_policies("boundary '" + c + "' at " + std::to_string(at),
+                     doc_at(c, at), 4096);
+    }
+  }
+}
+
+// constructs larger than the initial buffers
+// _____________________________________________________________________________
+void test_large() {
+  std::string many = "<e";
+  for (size_t i = 0; i < 5000; i++)
+    many += " a" + std::to_string(i) + "=\"value" + std::to_string(i) + "\"";
+  many += "/>";
+
+  // whitespace which needs several buffer growths
+  std::string sp(300000, ' ');
+
+  const std::vector<std::string> constructs = {
+      "<e a=\"" + std::string(100000, 'v') + "\"/>",
+      "<e b='1' a=\"" + std::string(300000, 'v') + "\" c='2'>t</e>",
+      many,
+      "<e" + std::string(100000, ' ') + "a=\"1\"" +
+          std::string(100000, '\n') + "/>",
+      "<e>" + std::string(200000, 't') + "</e>",
+      "<!--" + std::string(200000, '-') + "x-->",
+      "<" + std::string(70000, 'n') + " a='1'></" + std::string(70000, 'n') +
+          ">",
+      "<e k=\"1\"" + sp + "y=\"2\"" + sp + "/>",
+      "<e k=\"1\"" + sp + "y" + sp + "=" + sp + "'2'>" + sp + "<f/></e>",
+      "<e k=\"1\"/" + sp + ">",
+      "<e k=\"1\"></e" + sp + ">",
+  };
+
+  for (const auto& c : constructs) {
+    // at the start of the first buffer and in front of its end
+    for (size_t k : {pfxml::INIT_BUFFER_S - 10, size_t(1000), size_t(100),
+                     size_t(7), size_t(1)}) {
+      size_t at = pfxml::INIT_BUFFER_S - k;
+      check_policies("large construct of " + std::to_string(c.size()) +
+                         " bytes at " + std::to_string(at),
+                     doc_at(c, at), 65536,
+                     std::max(pfxml::PUSH_BUFFER_S, 2 * c.size()));
+    }
+  }
+
+  // the values themselves, not only their consistency between the modes
+  std::string xml = doc_at(constructs[1], pfxml::INIT_BUFFER_S - 7);
+  tmp_file tmp(xml);
+  pfxml::file f(tmp.path());
+  bool seen = false;
+  while (f.next()) {
+    if (std::string(f.get().name) != "e") continue;
+    PFXML_CHECK_EQ(std::string(f.get().attr("a")), std::string(300000, 'v'));
+    PFXML_CHECK_EQ(std::string(f.get().attr("b")), "1");
+    PFXML_CHECK_EQ(std::string(f.get().attr("c")), "2");
+    seen = true;
+  }
+  PFXML_CHECK(seen);
+}
+
+// push mode with single-byte feeds resumes within every token
+// _____________________________________________________________________________
+void test_push_bytes() {
+  std::string xml =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<osm version='0.6'>\n"
+      "  <node id=\"1\" lat=\"1.5\" lon=\"2.5\"/>\n"
+      "  <way id=\"2\"><nd ref=\"1\"/><tag k=\"a &amp; b\" v='&lt;x&gt;'/>"
+      "</way>\n  <!-- comment -- - -->\n  <?pi data?>\n"
+      "  <text>some &#228; text</text>\n"
+      "  <relation   id = \"3\" >\n    <member type='way' ref=\"2\"/>\n"
+      "  </relation >\n</osm>\n";
+  check_policies("push, single bytes", xml, 1);
+
+  std::string big = "<osm>";
+  for (size_t i = 0; i < 2000; i++) {
+    big += "<node id=\"" + std::to_string(i) + "\" v='" +
+           std::string(i % 97, 'a') + "'>" + std::string(i % 13, 't') +
+           "<!--" + std::string(i % 5, '-') + "x--></node>";
+  }
+  big += "</osm>";
+  check_policies("push, single bytes, many refills", big, 1);
+}
+
+// comments whose terminator would overlap the opening
+// _____________________________________________________________________________
+void test_comments() {
+  const std::vector<std::string> docs = {
+      "<a><!-->--><b/></a>",
+      "<a><!--->--><b/></a>",
+      "<a><!----><b/></a>",
+      "<a><!-- x - y --><b/></a>",
+  };
+  for (const auto& d : docs) {
+    std::string exp = "1 <a> []\n2 <b> []\n";
+    PFXML_CHECK_EQ(reference(d, true, true), exp);
+    check_policies(d, d, 1);
+  }
+}
+
+// _____________________________________________________________________________
+int main() {
+  test_boundaries();
+  test_large();
+  test_push_bytes();
+  test_comments();
+  return pfxml::test::result("parser_test");
+}
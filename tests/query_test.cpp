@@ -0,0 +1,75 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#include <iostream>
+#include <string>
+
+#include "pfxml/pfxml.h"
+#include "pfxml/query.h"
+#include "test.h"
+
+static const char* DOC =
+    "<osm>"
+    "<node id=\"1\"><tag k=\"amenity\" v=\"cafe\"/></node>"
+    "<node id=\"2\"><tag k=\"a&amp;b\" v=\"&lt;x&gt;\"/></node>"
+    "<way id=\"3\"><nd ref=\"1\"/><nd ref=\"2\"/>"
+    "<tag k=\"highway\" v=\"primary\"/></way>"
+    "<relation id=\"4\"><member ref=\"3\"/>"
+    "<relation id=\"5\"><member ref=\"4\"/></relation></relation>"
+    "</osm>";
+
+// the matches of path in DOC, one per line with their level, name and id
+// or selected value
+// _____________________________________________________________________________
+std::string matches(const std::string& path) {
+  std::string doc(DOC);
+  pfxml::file xml;
+  xml.open(doc.data(), doc.size());
+  pfxml::query q(path);
+
+  std::string ret;
+  while (q.next(xml)) {
+    const char* id = q.get().attr("id");
+    ret += std::to_string(q.level()) + " " + q.get().name + " " +
+           (q.value() ? q.value() : id ? id : "") + "\n";
+  }
+  return ret;
+}
+
+// _____________________________________________________________________________
+bool rejected(const std::string& path) {
+  try {
+    pfxml::query q(path);
+  } catch (const pfxml::query_exc& e) {
+    return true;
+  }
+  return false;
+}
+
+// _____________________________________________________________________________
+int main() {
+  PFXML_CHECK_EQ(matches("/osm/node"), "2 node 1\n2 node 2\n");
+  PFXML_CHECK_EQ(matches("/osm/way/nd/@ref"), "3 nd 1\n3 nd 2\n");
+  PFXML_CHECK_EQ(matches("//member/@ref"), "3 member 3\n4 member 4\n");
+  PFXML_CHECK_EQ(matches("//relation"), "2 relation 4\n3 relation 5\n");
+  PFXML_CHECK_EQ(matches("/osm/*[@id='3']"), "2 way 3\n");
+  PFXML_CHECK_EQ(matches("/osm/*/nd[@ref]"), "3 nd \n3 nd \n");
+  PFXML_CHECK_EQ(matches("/osm/node/tag[@k='nope']"), "");
+  PFXML_CHECK_EQ(matches("/node"), "");
+
+  // values are decoded, both in predicates and in the selection
+  PFXML_CHECK_EQ(matches("//tag[@k='a&b']/@v"), "3 tag <x>\n");
+
+  // child predicates report the element after its children
+  PFXML_CHECK_EQ(matches("/osm/node[tag/@k='amenity']"), "2 node 1\n");
+  PFXML_CHECK_EQ(matches("/osm/way[tag/@v='primary']/@id"), "2 way 3\n");
+  PFXML_CHECK_EQ(matches("/osm/*[nd]"), "2 way 3\n");
+
+  PFXML_CHECK(rejected(""));
+  PFXML_CHECK(rejected("osm"));
+  PFXML_CHECK(rejected("/osm/way[@k"));
+  PFXML_CHECK(rejected("/osm/way[nd]/nd"));
+  PFXML_CHECK(rejected("//@ref"));
+
+  return pfxml::test::result("query_test");
+}
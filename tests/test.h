@@ -0,0 +1,146 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#ifndef PFXML_TESTS_TEST_H_
+#define PFXML_TESTS_TEST_H_
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "pfxml/pfxml.h"
+
+// Minimal test helpers. A failed check is reported with its location and
+// makes the test binary fail.
+
+namespace pfxml {
+namespace test {
+
+static int failures = 0;
+
+#define PFXML_CHECK(c) pfxml::test::check((c), #c, __FILE__, __LINE__)
+#define PFXML_CHECK_EQ(a, b) \
+  pfxml::test::check_eq((a), (b), #a " == " #b, __FILE__, __LINE__)
+
+// _____________________________________________________________________________
+inline std::string shorten(const std::string& s) {
+  if (s.size() <= 400) return s;
+  return s.substr(0, 400) + "... (" + std::to_string(s.size()) + " bytes)";
+}
+
+// _____________________________________________________________________________
+inline void check(bool ok, const char* expr, const char* file, int line) {
+  if (ok) return;
+  std::cerr << file << ":" << line << ": " << expr << " failed" << std::endl;
+  failures++;
+}
+
+// _____________________________________________________________________________
+template <typename A, typename B>
+inline void check_eq(const A& a, const B& b, const char* expr,
+                     const char* file, int line) {
+  if (a == b) return;
+  std::ostringstream got, exp;
+  got << a;
+  exp << b;
+  std::cerr << file << ":" << line << ": " << expr << " failed\n"
+            << "  got:      " << shorten(got.str()) << "\n"
+            << "  expected: " << shorten(exp.str()) << std::endl;
+  failures++;
+}
+
+// one line per event: level, name, attributes and text. Text events are
+// only written if text is set, attributes only if attrs is set
+template <typename F>
+inline void dump_event(const F& xml, bool text, bool attrs, std::ostream* out) {
+  const tag& t = xml.get();
+  if (!*t.name && !text) return;
+  *out << xml.level() << " <" << t.name << ">";
+  if (attrs) {
+    for (const auto& kv : t.all_attrs())
+      *out << " " << kv.first << "=[" << kv.second << "]";
+  }
+  if (text) *out << " [" << t.text << "]";
+  *out << "\n";
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline std::string dump(F* xml, bool text, bool attrs) {
+  std::ostringstream out;
+  while (xml->next()) dump_event(*xml, text, attrs, &out);
+  return out.str();
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline std::string dump(F* xml) {
+  return dump(xml, F::policy::text, F::policy::attrs);
+}
+
+// feed data in pieces of n bytes into a parser in push mode. The first
+// piece has at least first bytes, the encoding is detected from it
+template <typename F>
+inline std::string dump_push(F* xml, const std::string& data, size_t n,
+                             bool text, bool attrs, size_t first = 0) {
+  std::ostringstream out;
+  size_t pos = 0;
+  while (true) {
+    while (xml->next()) dump_event(*xml, text, attrs, &out);
+    if (!xml->needs_input()) break;
+    if (pos == data.size()) {
+      xml->finish();
+      continue;
+    }
+    size_t k = std::min(pos ? n : std::max(n, first), data.size() - pos);
+    xml->feed(data.data() + pos, k);
+    pos += k;
+  }
+  return out.str();
+}
+
+// a temporary file with the given content, removed on destruction
+class tmp_file {
+ public:
+  explicit tmp_file(const std::string& content);
+  ~tmp_file();
+  const std::string& path() const { return _path; }
+
+ private:
+  std::string _path;
+};
+
+// _____________________________________________________________________________
+inline tmp_file::tmp_file(const std::string& content) {
+  char name[] = "/tmp/pfxml-test-XXXXXX";
+  int fd = mkstemp(name);
+  if (fd < 0) {
+    std::cerr << "could not create temporary file" << std::endl;
+    exit(1);
+  }
+  _path = name;
+  FILE* f = fdopen(fd, "w");
+  if (!f || fwrite(content.data(), 1, content.size(), f) != content.size() ||
+      fclose(f) != 0) {
+    std::cerr << "could not write " << _path << std::endl;
+    exit(1);
+  }
+}
+
+// _____________________________________________________________________________
+inline tmp_file::~tmp_file() { unlink(_path.c_str()); }
+
+// _____________________________________________________________________________
+inline int result(const char* name) {
+  if (failures) std::cerr << name << ": " << failures << " failed checks\n";
+  return failures ? 1 : 0;
+}
+}  // namespace test
+}  // namespace pfxml
+
+#endif  // PFXML_TESTS_TEST_H_
@@ -0,0 +1,188 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pfxml/pfxml.h"
+#include "pfxml/pipeline.h"
+#include "util.h"
+
+// only element names are needed
+struct count_policy {
+  static const bool validate = true;
+  static const bool text = false;
+  static const bool meta = false;
+  static const bool attrs = false;
+  static const bool utf8 = false;
+  static const bool lazy = false;
+  static const bool offsets = false;
+};
+
+typedef pfxml::basic_file<count_policy> count_file;
+
+// counts elements per depth and name
+class counter : public pfxml::consumer {
+ public:
+  counter(bool depth, size_t only) : _depth(depth), _only(only), _events(0) {}
+
+  void event(const pfxml::tag& t, size_t level) {
+    _events++;
+    if (!*t.name || (_only && level != _only)) return;
+    size_t d = _depth ? level : 0;
+    if (d >= _counts.size()) _counts.resize(d + 1);
+    _key.assign(t.name);
+    _counts[d][_key]++;
+  }
+
+  void merge(const counter& c) {
+    if (c._counts.size() > _counts.size()) _counts.resize(c._counts.size());
+    for (size_t d = 0; d < c._counts.size(); d++) {
+      for (const auto& kv : c._counts[d]) _counts[d][kv.first] += kv.second;
+    }
+    _events += c._events;
+  }
+
+  void print() const {
+    struct row {
+      size_t n;
+      size_t depth;
+      const std::string* name;
+    };
+    std::vector<row> rows;
+    for (size_t d = 0; d < _counts.size(); d++) {
+      for (const auto& kv : _counts[d]) {
+        rows.push_back({kv.second, d, &kv.first});
+      }
+    }
+    std::sort(rows.begin(), rows.end(), [](const row& a, const row& b) {
+      if (a.n != b.n) return a.n > b.n;
+      if (a.depth != b.depth) return a.depth < b.depth;
+      return *a.name < *b.name;
+    });
+    for (const auto& r : rows) {
+      if (_depth) {
+        printf("%zu\t%zu\t%s\n", r.n, r.depth, r.name->c_str());
+      } else {
+        printf("%zu\t%s\n", r.n, r.name->c_str());
+      }
+    }
+  }
+
+  size_t events() const { return _events; }
+
+  size_t total() const {
+    size_t n = 0;
+    for (const auto& m : _counts) {
+      for (const auto& kv : m) n += kv.second;
+    }
+    return n;
+  }
+
+ private:
+  bool _depth;
+  size_t _only;
+  size_t _events;
+  std::string _key;
+  std::vector<std::unordered_map<std::string, size_t>> _counts;
+};
+
+// _____________________________________________________________________________
+void usage() {
+  std::cerr
+      << "Usage: pfxml-count [options] <file>\n\n"
+      << "Count the elements of an XML file (optionally .gz or .bz2) by "
+      << "name.\n\n"
+      << "  -d, --depth          count per depth and name\n"
+      << "  -l, --level <n>      only count elements at depth n (root: 1)\n"
+      << "  -j, --threads <n>    count in n worker threads (default: 1)\n"
+      << "  -i, --input-compression <c>\n"
+      << "                       input compression: none, gzip, bzip2\n"
+      << "                       (default: by file extension)\n"
+      << "  -s, --stats          print statistics to stderr\n"
+      << "  -h, --help           print this help\n";
+}
+
+// _____________________________________________________________________________
+int main(int argc, char** argv) {
+  bool depth = false;
+  bool st = false;
+  size_t only = 0;
+  size_t threads = 1;
+  std::string icomp;
+
+  static const option opts[] = {{"depth", no_argument, 0, 'd'},
+                                {"level", required_argument, 0, 'l'},
+                                {"threads", required_argument, 0, 'j'},
+                                {"input-compression", required_argument, 0,
+                                 'i'},
+                                {"stats", no_argument, 0, 's'},
+                                {"help", no_argument, 0, 'h'},
+                                {0, 0, 0, 0}};
+
+  try {
+    int c;
+    while ((c = getopt_long(argc, argv, "dl:j:i:sh", opts, 0)) != -1) {
+      switch (c) {
+        case 'd':
+          depth = true;
+          break;
+        case 'l':
+          only = pfxml::tools::parse_num(optarg, "level");
+          break;
+        case 'j':
+          threads = pfxml::tools::parse_num(optarg, "number of threads");
+          break;
+        case 'i':
+          icomp = optarg;
+          break;
+        case 's':
+          st = true;
+          break;
+        case 'h':
+          usage();
+          return 0;
+        default:
+          usage();
+          return 1;
+      }
+    }
+
+    if (optind + 1 != argc) {
+      usage();
+      return 1;
+    }
+
+    pfxml::tools::stats stats;
+    std::unique_ptr<count_file> xml(
+        pfxml::tools::open_file<count_file>(argv[optind], icomp));
+    counter res(depth, only);
+
+    if (threads == 1) {
+      while (xml->next()) res.event(xml->get(), xml->level());
+    } else {
+      std::vector<counter> counters(threads, counter(depth, only));
+      pfxml::pipeline p;
+      for (auto& c : counters) p.add(&c);
+      p.run(*xml);
+      for (const auto& c : counters) res.merge(c);
+    }
+
+    res.print();
+    if (st) {
+      stats.print(argv[optind], xml->bytes_read(), res.events(),
+                  res.total());
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "pfxml-count: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
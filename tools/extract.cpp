@@ -0,0 +1,128 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#include <getopt.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "pfxml/pfxml.h"
+#include "pfxml/query.h"
+#include "pfxml/writer.h"
+#include "util.h"
+
+// _____________________________________________________________________________
+void usage() {
+  std::cerr
+      << "Usage: pfxml-extract [options] <query> <file>\n\n"
+      << "Copy the subtrees of all elements in an XML file (optionally .gz or\n"
+      << ".bz2) matching a path query into a new document, below a copy of\n"
+      << "the input's root element. Child predicates are not supported.\n"
+      << "Example:\n\n"
+      << "  pfxml-extract -o ways.osm.gz \"/osm/way[@highway]\" map.osm.bz2\n\n"
+      << "  -o, --output <file>  write to file instead of stdout, compressed\n"
+      << "                       according to its extension\n"
+      << "  -z, --compress <c>   output compression: none, gzip, bzip2, zstd\n"
+      << "  -t, --compress-threads <n>\n"
+      << "                       compression threads (default: 1)\n"
+      << "  -i, --input-compression <c>\n"
+      << "                       input compression: none, gzip, bzip2\n"
+      << "                       (default: by file extension)\n"
+      << "  -s, --stats          print statistics to stderr\n"
+      << "  -h, --help           print this help\n";
+}
+
+// _____________________________________________________________________________
+int main(int argc, char** argv) {
+  bool st = false;
+  std::string out = "-";
+  std::string comp;
+  size_t threads = 1;
+  std::string icomp;
+
+  static const option opts[] = {{"output", required_argument, 0, 'o'},
+                                {"compress", required_argument, 0, 'z'},
+                                {"compress-threads", required_argument, 0,
+                                 't'},
+                                {"input-compression", required_argument, 0,
+                                 'i'},
+                                {"stats", no_argument, 0, 's'},
+                                {"help", no_argument, 0, 'h'},
+                                {0, 0, 0, 0}};
+
+  try {
+    int c;
+    while ((c = getopt_long(argc, argv, "o:z:t:i:sh", opts, 0)) != -1) {
+      switch (c) {
+        case 'o':
+          out = optarg;
+          break;
+        case 'z':
+          comp = optarg;
+          break;
+        case 't':
+          threads =
+              pfxml::tools::parse_num(optarg, "number of compression threads");
+          break;
+        case 'i':
+          icomp = optarg;
+          break;
+        case 's':
+          st = true;
+          break;
+        case 'h':
+          usage();
+          return 0;
+        default:
+          usage();
+          return 1;
+      }
+    }
+
+    if (optind + 2 != argc) {
+      usage();
+      return 1;
+    }
+
+    pfxml::tools::stats stats;
+    pfxml::query q(argv[optind]);
+    if (q.child_preds())
+      throw std::runtime_error("child predicates are not supported");
+
+    std::unique_ptr<pfxml::file> xml(
+        pfxml::tools::open_file<pfxml::file>(argv[optind + 1], icomp));
+    std::unique_ptr<pfxml::writer> w(
+        pfxml::tools::open_writer(out, comp, threads));
+
+    size_t matches = 0;
+    w->decl();
+
+    if (xml->next()) {
+      // the root element, which is also seen by the query
+      w->copy(xml->get(), 1);
+      q.resume();
+
+      while (q.next(*xml)) {
+        matches++;
+
+        size_t lvl = xml->level();
+        w->copy(xml->get(), 2);
+
+        bool more;
+        while ((more = xml->next()) && xml->level() > lvl) {
+          w->copy(xml->get(), xml->level() - lvl + 2);
+        }
+        if (!more) break;
+        q.resume();
+      }
+    }
+    w->finish();
+
+    if (st) stats.print(argv[optind + 1], xml->bytes_read(), 0, matches);
+  } catch (const std::exception& e) {
+    std::cerr << "pfxml-extract: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
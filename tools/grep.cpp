@@ -0,0 +1,171 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#include <getopt.h>
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "pfxml/pfxml.h"
+#include "pfxml/query.h"
+#include "pfxml/writer.h"
+#include "util.h"
+
+// the offsets are printed with -b
+struct grep_policy : pfxml::default_policy {
+  static const bool offsets = true;
+};
+
+// _____________________________________________________________________________
+void usage() {
+  std::cerr
+      << "Usage: pfxml-grep [options] <query> <file>\n\n"
+      << "Print the start tags of all elements in an XML file (optionally .gz\n"
+      << "or .bz2) matching a path query, one per line. If the query selects\n"
+      << "an attribute, its decoded values are printed instead. Examples:\n\n"
+      << "  pfxml-grep \"//way[@highway='primary']\" map.osm.bz2\n"
+      << "  pfxml-grep \"/osm/way/nd/@ref\" map.osm\n\n"
+      << "  -c, --count          only print the number of matches\n"
+      << "  -b, --byte-offset    prefix each match with its byte offset in\n"
+      << "                       the (decompressed) input\n"
+      << "  -o, --output <file>  write to file instead of stdout, compressed\n"
+      << "                       according to its extension\n"
+      << "  -z, --compress <c>   output compression: none, gzip, bzip2, zstd\n"
+      << "  -t, --compress-threads <n>\n"
+      << "                       compression threads (default: 1)\n"
+      << "  -i, --input-compression <c>\n"
+      << "                       input compression: none, gzip, bzip2\n"
+      << "                       (default: by file extension)\n"
+      << "  -s, --stats          print statistics to stderr\n"
+      << "  -h, --help           print this help\n";
+}
+
+// _____________________________________________________________________________
+void start_tag(const pfxml::tag& t, std::string* out) {
+  out->push_back('<');
+  out->append(t.name);
+  for (const auto& kv : t.all_attrs()) {
+    // values are printed as they appear in the input
+    char q = strchr(kv.second, '"') ? '\'' : '"';
+    out->push_back(' ');
+    out->append(kv.first);
+    out->push_back('=');
+    out->push_back(q);
+    out->append(kv.second);
+    out->push_back(q);
+  }
+  out->push_back('>');
+}
+
+// _____________________________________________________________________________
+int main(int argc, char** argv) {
+  bool count = false;
+  bool offsets = false;
+  bool st = false;
+  std::string out = "-";
+  std::string comp;
+  size_t threads = 1;
+  std::string icomp;
+
+  static const option opts[] = {{"count", no_argument, 0, 'c'},
+                                {"byte-offset", no_argument, 0, 'b'},
+                                {"output", required_argument, 0, 'o'},
+                                {"compress", required_argument, 0, 'z'},
+                                {"compress-threads", required_argument, 0,
+                                 't'},
+                                {"input-compression", required_argument, 0,
+                                 'i'},
+                                {"stats", no_argument, 0, 's'},
+                                {"help", no_argument, 0, 'h'},
+                                {0, 0, 0, 0}};
+
+  try {
+    int c;
+    while ((c = getopt_long(argc, argv, "cbo:z:t:i:sh", opts, 0)) != -1) {
+      switch (c) {
+        case 'c':
+          count = true;
+          break;
+        case 'b':
+          offsets = true;
+          break;
+        case 'o':
+          out = optarg;
+          break;
+        case 'z':
+          comp = optarg;
+          break;
+        case 't':
+          threads =
+              pfxml::tools::parse_num(optarg, "number of compression threads");
+          break;
+        case 'i':
+          icomp = optarg;
+          break;
+        case 's':
+          st = true;
+          break;
+        case 'h':
+          usage();
+          return 0;
+        default:
+          usage();
+          return 1;
+      }
+    }
+
+    if (optind + 2 != argc) {
+      usage();
+      return 1;
+    }
+
+    pfxml::tools::stats stats;
+    pfxml::query q(argv[optind]);
+    typedef pfxml::basic_file<grep_policy> grep_file;
+    std::unique_ptr<grep_file> xml(
+        pfxml::tools::open_file<grep_file>(argv[optind + 1], icomp));
+    std::unique_ptr<pfxml::writer> w(
+        pfxml::tools::open_writer(out, comp, threads));
+
+    size_t matches = 0;
+    std::string line;
+
+    while (q.next(*xml)) {
+      matches++;
+      if (count) continue;
+
+      line.clear();
+      if (offsets) {
+        // elements with child predicates are reported after their children,
+        // their offset is no longer known
+        if (&q.get() == &xml->get()) {
+          line.append(std::to_string(xml->offset()));
+        } else {
+          line.push_back('-');
+        }
+        line.push_back('\t');
+      }
+      if (q.value()) {
+        line.append(q.value());
+      } else {
+        start_tag(q.get(), &line);
+      }
+      line.push_back('\n');
+      w->raw(line.data(), line.size());
+    }
+
+    if (count) {
+      line = std::to_string(matches) + "\n";
+      w->raw(line.data(), line.size());
+    }
+    w->finish();
+
+    if (st) stats.print(argv[optind + 1], xml->bytes_read(), 0, matches);
+  } catch (const std::exception& e) {
+    std::cerr << "pfxml-grep: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
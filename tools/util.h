@@ -0,0 +1,77 @@
+// Copyright 2017 Patrick Brosi
+// info@patrickbrosi.de
+
+#ifndef PFXML_TOOLS_UTIL_H_
+#define PFXML_TOOLS_UTIL_H_
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include "pfxml/writer.h"
+
+namespace pfxml {
+namespace tools {
+
+// run time statistics, printed to stderr with --stats
+class stats {
+ public:
+  stats() : _start(std::chrono::steady_clock::now()) {}
+
+  void print(const std::string& path, int64_t bytes, size_t events,
+             size_t matches) const {
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - _start)
+                      .count();
+    fprintf(stderr, "input:      %s\n", path.c_str());
+    fprintf(stderr, "bytes:      %lld\n", static_cast<long long>(bytes));
+    if (events) fprintf(stderr, "events:     %zu\n", events);
+    fprintf(stderr, "matches:    %zu\n", matches);
+    fprintf(stderr, "time:       %.3f s\n", secs);
+    fprintf(stderr, "throughput: %.1f MB/s\n", bytes / secs / 1000000.0);
+  }
+
+ private:
+  std::chrono::steady_clock::time_point _start;
+};
+
+// _____________________________________________________________________________
+inline compression parse_compression(const std::string& s) {
+  if (s == "none" || s == "plain") return PLAIN;
+  if (s == "gzip" || s == "gz") return GZIP;
+  if (s == "bzip2" || s == "bz2") return BZIP2;
+  if (s == "zstd" || s == "zst") return ZSTD;
+  throw std::runtime_error("unknown compression '" + s + "'");
+}
+
+// _____________________________________________________________________________
+inline writer* open_writer(const std::string& path, const std::string& comp,
+                           size_t threads) {
+  // without an explicit compression, the writer uses the file extension
+  if (comp.empty()) return new writer(path, threads);
+  return new writer(path, parse_compression(comp), threads);
+}
+
+// _____________________________________________________________________________
+template <typename F>
+inline F* open_file(const std::string& path, const std::string& comp) {
+  // without an explicit compression, the parser uses the file extension
+  if (comp.empty()) return new F(path);
+  return new F(path, parse_compression(comp));
+}
+
+// _____________________________________________________________________________
+inline size_t parse_num(const char* s, const char* what) {
+  char* end;
+  long n = strtol(s, &end, 10);
+  if (*end || n < 1) {
+    throw std::runtime_error(std::string("invalid ") + what + " '" + s + "'");
+  }
+  return n;
+}
+}  // namespace tools
+}  // namespace pfxml
+
+#endif  // PFXML_TOOLS_UTIL_H_